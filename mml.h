@@ -9,6 +9,32 @@
  *      http://benjaminsoule.fr/tools/vmml/
  * -    uses standard math.h and includes Sean Barrett's stretchy_buffer
  *      library (https://github.com/nothings/stb)
+ * -    every allocation goes through MML_MALLOC, MML_REALLOC and MML_FREE,
+ *      define all three before the implementation to use your own allocator
+ * -    mml_render_all uses pthreads (link with -pthread) or win32 threads,
+ *      define MML_NO_THREADS to have it render on the calling thread
+ * -    tNNN sets the tempo in quarter notes per minute for the whole song
+ *      from that point on, whichever track it's in. songs without one play
+ *      at t240 (a whole note per second). inside a loop it's set again in
+ *      every pass, as in the loop written out (up to 65536 changes in all,
+ *      later passes keep the tempo they start with), patterns ignore it
+ * -    [ ... ]n repeats a phrase n times (twice without n), nested up to
+ *      MML_MAX_LOOP_DEPTH deep. L marks where the song goes back to when
+ *      it reaches its end, the start of the song without one
+ * -    $n{ ... } defines pattern n once and $n plays it in any track. a
+ *      pattern starts from the default octave, length, volume and gate,
+ *      and may use loops and the patterns defined before it
+ * -    the phase oscillator modes mix with sse2/avx2 (picked at run time) or
+ *      neon kernels, define MML_NO_SIMD to use the plain C loop. they play
+ *      band-limited wavetables, one per octave, built once (about 300KB)
+ *      the first time a player picks a phase mode
+ * -    Pn pans the notes after it from P0 (left) through P64 (center) to
+ *      P127 (right). mml_decode_frames writes interleaved stereo or
+ *      N channel float or int16 frames with each track panned into them,
+ *      mono output ignores pan
+ * -    mml_ring_* hands frames from a render thread to an audio callback
+ *      without locks, using the gcc/clang __atomic builtins (Interlocked
+ *      on msvc)
 * 
 // Version History
 // 0.6  (2019-12-07)    Wave definitions, measure cycling
@@ -24,51 +50,262 @@
 #define __INCLUDED__MML_H__
 
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
-typedef struct {
-    double length;
-    double accum_time;
-    double volume;
-    float frequency;
-} mml_note_t;
+/* oscillator modes, see mml_set_oscillator */
+enum {
+    MML_OSC_TIME,           /* wave sampled from absolute song time (default) */
+    MML_OSC_PHASE_16,       /* integer phase accumulator, band-limited 16 step wavetables */
+    MML_OSC_PHASE_32        /* integer phase accumulator, band-limited 32 step wavetables */
+};
+
+#define MML_PITCH_COUNT     108     /* 9 octaves of 12 notes */
+#define MML_PITCH_REST      0xff
+#define MML_TICKS_PER_WHOLE 960     /* song time unit */
+#define MML_DEFAULT_TEMPO   240     /* a whole note per second */
+#define MML_PITCH_LOOP_BEGIN 0xfe   /* '[' record */
+#define MML_PITCH_LOOP_END  0xfd    /* ']' record, see mml_song_t */
+#define MML_PITCH_CALL      0xfc    /* '$n' record, its argument is the pattern */
+#define MML_PITCH_RETURN    0xfb    /* ends every pattern */
+#define MML_MAX_LOOP_DEPTH  8       /* loops and patterns inside each other */
+#define MML_MAX_LOOP_COUNT  255     /* passes through one loop */
+#define MML_NOTE_MAX_TICKS  0xffff  /* longer notes take several records */
+#define MML_PAN_CENTER      64      /* 'P' from 0 (left) to MML_PAN_MAX (right) */
+#define MML_PAN_MAX         127
+#define MML_MAX_CHANNELS    8       /* for mml_decode_frames */
 
+/*  one song record in 8 bytes. a note sounds for the first gate ticks of
+ *  its length and is silent for the rest, so the 'q' gap needs no record
+ *  of its own. rests have a gate of 0. loop, call and return records keep
+ *  a 32 bit argument in length (low half) and gate (high half) */
 typedef struct {
-    double accum_time;
-    float speed_multiplier;
-    unsigned int * track_pos;
-} mml_decode_state_t;
+    uint16_t length;            /* in ticks */
+    uint16_t gate;              /* ticks it sounds for, at most length */
+    unsigned char pitch;        /* 12*octave+note, MML_PITCH_REST or a control record */
+    unsigned char volume;       /* index into the 'v'/'q' step table */
+    unsigned char depth;        /* loops and patterns the record is inside */
+    unsigned char pan;          /* 0 to MML_PAN_MAX */
+} mml_note_t;
 
+/*  song data is read-only once parsed and can be shared by any number of
+ *  players on any thread. every track's records are stored back to back in
+ *  notes, with their start ticks in starts, track i covers indexes
+ *  [track_offsets[i], track_offsets[i]+track_lengths[i]). a song from
+ *  mml_edit_apply has unused room after each track.
+ *  a loop is stored once between a MML_PITCH_LOOP_BEGIN and a
+ *  MML_PITCH_LOOP_END record. the end record's volume is the number of
+ *  passes and its argument how many records back its begin is, its start
+ *  is the tick after the last pass. starts count every pass of the loops
+ *  before a note but only the first of the ones around it.
+ *  patterns are kept ahead of the tracks in the same arrays, each ending
+ *  in a MML_PITCH_RETURN record, and tracks play them with
+ *  MML_PITCH_CALL records. their starts count from the pattern's start */
 typedef struct {
-    double length;
+    uint32_t length;            /* in ticks */
+    uint32_t loop_tick;         /* where the song goes on from at its end */
     double volume;
-    unsigned int beats_per_minute;
+    unsigned int beats_per_minute;  /* starting tempo */
     unsigned int track_count;
     unsigned int * waves;     /* indexes into wavetable */
-    mml_note_t ** tracks;
-} mml_data_t;
+    unsigned int * track_lengths;   /* notes per track */
+    unsigned int * track_offsets;   /* first note of each track */
+    unsigned int pattern_count;
+    unsigned int * pattern_lengths; /* records per pattern, its return included */
+    unsigned int * pattern_offsets; /* first record of each pattern */
+    unsigned int tempo_count;   /* the tempo map, shared by every track */
+    uint32_t * tempo_ticks;     /* tick each tempo starts at, ascending from 0 */
+    unsigned int * tempo_bpm;   /* quarter notes per minute */
+    double * tempo_seconds;     /* song time each tempo starts at */
+    mml_note_t * notes;
+    uint32_t * starts;          /* record start ticks, each track from 0 */
+} mml_song_t;
+
+/*  everything that changes while a song plays: per track cursors and
+ *  phases plus song time. one song can drive many players */
+typedef struct {
+    const mml_song_t * song;
+    double rate;                /* sample rate the positions below are in */
+    uint32_t pos;               /* next sample to decode */
+    double frac;                /* how far past pos song time is, in samples */
+    double held;                /* the last mml_player_decode_stream sample */
+    uint32_t song_end;          /* song length in samples, at most 2^32-1 */
+    uint32_t loop_start;        /* sample the song goes back to at song_end */
+    double seek_time;           /* seconds, applied once the rate is known */
+    unsigned int * track_pos;
+    int oscillator;             /* MML_OSC_* */
+    int resync;                 /* set by a seek, positions and phases are stale */
+    uint32_t * phase;           /* per track oscillator phase */
+    uint32_t * note_end;        /* per track sample the current note or its gate ends before */
+    unsigned int * silent;      /* per track, resting or past the note's gate */
+    float * pan;                /* per track, -1 to 1 added to the song's pans */
+    uint32_t * voices;          /* sounding tracks, in track order */
+    uint32_t * resting;         /* resting tracks, heap on note_end */
+    unsigned int voice_count;
+    unsigned int rest_count;
+    uint32_t * tick_shift;      /* per track ticks added by repeated loops */
+    unsigned int * loop_depth;  /* per track loops and patterns the cursor is inside */
+    uint32_t * loop_counts;     /* MML_MAX_LOOP_DEPTH passes done (loops) or
+                                 * records to return to (patterns) per track */
+    uint32_t pitch_inc[MML_PITCH_COUNT];    /* phase increment per sample */
+} mml_player_t;
 
 typedef struct {
     double note_length;                 /* default is .25   */
     double hit_length;                  /* default is .75   */
-    double volume;                      /* default is 1.0   */
+    unsigned int volume;                /* default is 8 (1.0) */
     unsigned int octave;                /* default is 4     */
+    unsigned int pan;                   /* default is 64 (center) */
 } mml_read_state_t;
 
+/* a loaded song together with its own player */
 typedef struct {
-    mml_decode_state_t decode_state;
-    mml_data_t data;
+    mml_player_t player;
+    mml_song_t song;
 } mml_t;
 
+typedef struct mml_parser_t mml_parser_t;
+typedef struct mml_edit_t mml_edit_t;
+typedef struct mml_ring_t mml_ring_t;
+typedef struct mml_mixer_t mml_mixer_t;
+
 /* function prototypes */
+/* returns NULL if the file can't be opened or read */
 mml_t* mml_open_file(const char*);
+/* parses sz bytes of buf in place, buf is not copied, modified or freed
+ * and doesn't need to be NUL terminated */
 mml_t* mml_open_mem(const char*,unsigned int);
+/* parses a song that arrives in pieces, without ever holding the whole
+ * text. chunks may be cut anywhere, only the few bytes of a command split
+ * between two are kept. mml_parser_finish frees the parser and returns
+ * the song as mml_open_mem would for all the chunks back to back */
+mml_parser_t* mml_parser_create(void);
+void mml_parser_feed(mml_parser_t* p,const char* buf,unsigned int sz);
+mml_t* mml_parser_finish(mml_parser_t* p);
+/* keeps a song in step with a text being edited. mml_edit_apply takes
+ * the whole new text and where it changed, added bytes at at in place of
+ * removed old ones. only the track segments (from one ';' to the next)
+ * the change is inside are parsed again and spliced into the song in
+ * place, anything reaching outside its track (a 't', an 'L', a pattern
+ * definition) parses the whole text. the song changes or is replaced and
+ * the old one freed, so not while it's decoding, and its player goes on
+ * from the same sample. returns the song, which may be the same pointer,
+ * or NULL if the text doesn't make one and the old song is kept.
+ * an edit inside a track costs time in the segments parsed again, and if
+ * it adds or removes records, in the rest of that track. other tracks are
+ * only touched when the song's length changes */
+mml_edit_t* mml_edit_open(const char* buf,unsigned int sz);
+mml_t* mml_edit_apply(mml_edit_t* e,const char* buf,unsigned int sz,
+                      unsigned int at,unsigned int removed,unsigned int added);
+mml_t* mml_edit_song(const mml_edit_t* e);
+void mml_edit_free(mml_edit_t* e);
+/* compiled songs are the parsed data in a flat, versioned binary layout
+ * that loads with a single allocation and no parsing. the _mem variants
+ * work on caller owned (e.g. mapped) memory, mml_save_compiled_mem
+ * returns the bytes needed and only writes when sz is large enough.
+ * loading returns NULL for a missing file or bad data */
+mml_t* mml_open_compiled(const char* filename);
+mml_t* mml_open_compiled_mem(const void* buf,unsigned int sz);
+int mml_save_compiled(const mml_t* m,const char* filename);
+unsigned int mml_save_compiled_mem(const mml_t* m,void* buf,unsigned int sz);
 void mml_free(mml_t*);
 void mml_reset_decode_state(mml_t*);
+/* the next sample, dt seconds after the last one. keeping dt the same is
+ * the fast path: a new dt is a new sample rate, which recomputes the pitch
+ * steps and finds each track's place again at the same song time.
+ * dt <= 0 returns the last sample again without advancing */
 double mml_decode_stream(mml_t* m,double dt);
+/* fills out[0..frames) with one mono sample per frame, same as calling
+ * mml_decode_stream(m,1.0/sample_rate) frames times. a sample_rate that
+ * isn't above 0 writes silence and doesn't advance */
+void mml_decode_block(mml_t* m,float* out,unsigned int frames,double sample_rate);
+/* fills out[0..frames*channels) with interleaved frames, each track
+ * panned across the channels at constant power between the two nearest
+ * (left to right for stereo). 1 channel is the same as mml_decode_block,
+ * at most MML_MAX_CHANNELS */
+void mml_decode_frames(mml_t* m,float* out,unsigned int frames,unsigned int channels,double sample_rate);
+void mml_decode_frames_s16(mml_t* m,int16_t* out,unsigned int frames,unsigned int channels,double sample_rate);
+/* moves a track's pans by pan, where -1 is all the way left and 1 right,
+ * on top of its 'P's. 0 (the default) leaves them as they are */
+void mml_set_pan(mml_t* m,unsigned int track,float pan);
+/* selects how tracks sample their wave, one of MML_OSC_*. the first
+ * switch to a phase mode in a program builds their wavetables, which
+ * blocks for about 5 ms (other threads doing the same wait for it), so
+ * make it before playback starts rather than on the audio thread */
+void mml_set_oscillator(mml_t* m,int mode);
+/* moves playback to a song time, times past the end wrap round from the
+ * loop point, and negative or non-finite times go to the start. a binary
+ * search per track (and per loop the time is inside), the cost doesn't
+ * depend on where playback was */
+void mml_seek(mml_t* m,double seconds);
+
+/* players only read the song, which must outlive them. the mml_t
+ * functions above are shorthands for these on m->player */
+mml_player_t* mml_player_create(const mml_song_t* song);
+void mml_player_free(mml_player_t* p);
+void mml_player_reset(mml_player_t* p);
+double mml_player_decode_stream(mml_player_t* p,double dt);
+void mml_player_decode_block(mml_player_t* p,float* out,unsigned int frames,double sample_rate);
+void mml_player_set_oscillator(mml_player_t* p,int mode);
+void mml_player_seek(mml_player_t* p,double seconds);
+void mml_player_decode_frames(mml_player_t* p,float* out,unsigned int frames,unsigned int channels,double sample_rate);
+void mml_player_decode_frames_s16(mml_player_t* p,int16_t* out,unsigned int frames,unsigned int channels,double sample_rate);
+void mml_player_set_pan(mml_player_t* p,unsigned int track,float pan);
+
+/* renders one pass through the song at sample_rate into a new buffer of
+ * *frames samples (release it with MML_FREE), split into contiguous time
+ * ranges rendered on up to threads threads. the output is bit-identical
+ * to mml_decode_block from the start of the song for any thread count.
+ * uses m's oscillator mode but doesn't touch its playback position.
+ * returns NULL with *frames 0 if sample_rate isn't a positive finite rate
+ * or the buffer can't be allocated */
+float* mml_render_all(const mml_t* m,double sample_rate,unsigned int threads,unsigned int* frames);
+
+/* a single producer, single consumer ring of frames for feeding an audio
+ * callback. a render thread keeps it topped up ahead of time, rendering
+ * whenever mml_ring_wanted says it has fallen under low_watermark, and
+ * the callback just copies out with mml_ring_read: no allocation, lock or
+ * decoding on the audio thread. one thread writes and one reads, each
+ * index is only ever stored by its own side. frames is rounded up to a
+ * power of two */
+mml_ring_t* mml_ring_create(unsigned int frames,unsigned int low_watermark);
+void mml_ring_free(mml_ring_t* r);
+/* producer: how much to render now (0 while at or above the watermark),
+ * then render or copy up to frames in. both return the frames written */
+unsigned int mml_ring_wanted(const mml_ring_t* r);
+unsigned int mml_ring_render(mml_ring_t* r,mml_player_t* p,double sample_rate,unsigned int frames);
+unsigned int mml_ring_write(mml_ring_t* r,const float* in,unsigned int frames);
+/* consumer: fills out[0..frames), with silence past what was buffered,
+ * which counts as an underrun. returns the frames that came from the ring */
+unsigned int mml_ring_read(mml_ring_t* r,float* out,unsigned int frames);
+/* either side: frames ready to read, and underruns so far along with the
+ * frames of silence they cost */
+unsigned int mml_ring_buffered(const mml_ring_t* r);
+unsigned int mml_ring_underruns(const mml_ring_t* r,unsigned int* frames_missed);
+
+/* mixes many songs, each with its own player, gain and pan, into one
+ * interleaved stereo stream. every pass of up to block frames renders
+ * each source on a pool of threads threads (the caller's included) that
+ * steal each other's work, then sums the sources a chunk of frames at a
+ * time, also spread over the pool. the sum is always in source order, so
+ * the output is bit-identical for any thread count. songs must outlive
+ * the mixer and sources are only changed between mixes. each source is
+ * rendered in stereo with its tracks' pans, then pan balances it from -1
+ * (left only) to 1 (right only) at constant power, 0 leaving it as is */
+mml_mixer_t* mml_mixer_create(unsigned int threads,unsigned int block);
+void mml_mixer_free(mml_mixer_t* mx);
+/* returns the source's id, or -1 if out of memory */
+int mml_mixer_add(mml_mixer_t* mx,const mml_song_t* song,float gain,float pan);
+void mml_mixer_remove(mml_mixer_t* mx,int id);
+void mml_mixer_set(mml_mixer_t* mx,int id,float gain,float pan);
+/* to seek a source or pick its oscillator */
+mml_player_t* mml_mixer_player(mml_mixer_t* mx,int id);
+/* writes frames stereo frames, 2*frames floats, to out */
+void mml_mixer_mix(mml_mixer_t* mx,float* out,unsigned int frames,double sample_rate);
 
 
 #ifdef __cplusplus
@@ -92,12 +329,85 @@ double mml_decode_stream(mml_t* m,double dt);
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsign-compare"
 
+#ifndef MML_MALLOC
+#define MML_MALLOC(sz)          malloc(sz)
+#define MML_REALLOC(p,sz)       realloc(p,sz)
+#define MML_FREE(p)             free(p)
+#endif
+
 #include <string.h>
 #include <assert.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#ifndef MML_NO_MMAP
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif /* MML_NO_MMAP */
+
+#ifndef MML_NO_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif /* MML_NO_THREADS */
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+/* gives the core up while waiting on another thread */
+#ifdef _WIN32
+#include <windows.h>
+#define MML__YIELD()                SwitchToThread()
+#else
+#include <sched.h>
+#define MML__YIELD()                sched_yield()
+#endif
+
+/*  acquire loads and release stores of the ring's indices and counters,
+ *  and a compare and swap for the wavetables' once-guard */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define MML__LOAD_ACQUIRE(x)        ( (uint32_t)_InterlockedOr((volatile long*)&(x),0) )
+#define MML__STORE_RELEASE(x,v)     _InterlockedExchange((volatile long*)&(x),(long)(v))
+#define MML__CAS32(x,old,new_)      ( (uint32_t)_InterlockedCompareExchange((volatile long*)&(x), \
+                                        (long)(new_),(long)(old)) == (old) )
+#else
+#define MML__LOAD_ACQUIRE(x)        __atomic_load_n(&(x),__ATOMIC_ACQUIRE)
+#define MML__STORE_RELEASE(x,v)     __atomic_store_n(&(x),(uint32_t)(v),__ATOMIC_RELEASE)
+#define MML__CAS32(x,old,new_)      __atomic_compare_exchange_n(&(x),&(old),(uint32_t)(new_),0, \
+                                        __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)
+#endif
+
+/* the mixer's work ranges, two 32 bit ends in one word */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define MML__LOAD64(x)              ( (uint64_t)_InterlockedCompareExchange64((volatile long long*)&(x),0,0) )
+#define MML__CAS64(x,old,new_)      ( (uint64_t)_InterlockedCompareExchange64((volatile long long*)&(x), \
+                                        (long long)(new_),(long long)(old)) == (old) )
+#else
+#define MML__LOAD64(x)              __atomic_load_n(&(x),__ATOMIC_ACQUIRE)
+#define MML__CAS64(x,old,new_)      __atomic_compare_exchange_n(&(x),&(old),(new_),0, \
+                                        __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)
+#endif
+
+#ifndef MML_NO_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MML__SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define MML__SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif /* MML_NO_SIMD */
+
 /* include stretchy buffer stuff */
 #ifndef STB_STRETCHY_BUFFER_H_INCLUDED
 #define STB_STRETCHY_BUFFER_H_INCLUDED
@@ -110,7 +420,7 @@ double mml_decode_stream(mml_t* m,double dt);
 #define sb_last   stb_sb_last
 #endif
 
-#define stb_sb_free(a)         ((a) ? free(stb__sbraw(a)),0 : 0)
+#define stb_sb_free(a)         ((a) ? MML_FREE(stb__sbraw(a)),0 : 0)
 #define stb_sb_push(a,v)       (stb__sbmaybegrow(a,1), (a)[stb__sbn(a)++] = (v))
 #define stb_sb_count(a)        ((a) ? stb__sbn(a) : 0)
 #define stb_sb_add(a,n)        (stb__sbmaybegrow(a,n), stb__sbn(a)+=(n), &(a)[stb__sbn(a)-(n)])
@@ -131,7 +441,7 @@ static void * stb__sbgrowf(void *arr, int increment, int itemsize)
    int dbl_cur = arr ? 2*stb__sbm(arr) : 0;
    int min_needed = stb_sb_count(arr) + increment;
    int m = dbl_cur > min_needed ? dbl_cur : min_needed;
-   int *p = (int *) realloc(arr ? stb__sbraw(arr) : 0, itemsize * m + sizeof(int)*2);
+   int *p = (int *) MML_REALLOC(arr ? stb__sbraw(arr) : 0, itemsize * m + sizeof(int)*2);
    if (p) {
       if (!arr)
          p[1] = 0;
@@ -181,7 +491,7 @@ enum {
     PLUS = 1
 };
 
-static unsigned char mml_wavetable[NUM_VOICES][16] = {
+static const unsigned char mml_wavetable[NUM_VOICES][16] = {
     {15,15,0,0,0,0,0,0,0,0,0,0,0,0,0,0},                    /* square-one-eighth */
     {15,15,15,15,0,0,0,0,0,0,0,0,0,0,0,0},                  /* square-quarter */
     {15,15,15,15,15,15,15,15,0,0,0,0,0,0,0,0},              /* square-half */
@@ -193,7 +503,7 @@ static unsigned char mml_wavetable[NUM_VOICES][16] = {
 };
 
 
-static unsigned char mml_wavetable_32[NUM_VOICES][32] = {
+static const unsigned char mml_wavetable_32[NUM_VOICES][32] = {
     { 31,31,31,31,0,0,0,0,0,0,0,0,0,0,0,0,
       0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},                    /* square-one-eighth */
     {31,31,31,31,31,31,31,31,0,0,0,0,0,0,0,0,
@@ -212,7 +522,7 @@ static unsigned char mml_wavetable_32[NUM_VOICES][32] = {
        16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31},          /* sawtooth */
 };
 
-static float mml_note_frequencies[108] = {
+static const float mml_note_frequencies[108] = {
 	16.35 	,
  	17.32 	,
 	18.35 	,
@@ -323,7 +633,7 @@ static float mml_note_frequencies[108] = {
    7902.13 	
 };
 
-static double mml_quant_values[9] = 
+static const double mml_quant_values[9] = 
     { 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.75, 0.9, 1.0 };
 
 #define NULLCHAR                '\0'
@@ -333,83 +643,441 @@ static double mml_quant_values[9] =
 #define MML_PI_twice            MML_PI*2.0
 #define MML_PI_inv              0.31831
 #define MML_PI_inv_twice        0.15915
+#define MML_SQRT2               1.41421356237
 #define SAMPLE_WAVETABLE(t,voice,note) \
         mml_wavetable[voice][(int)(roundf(BITS_PER_NOTE*GET_DECIMAL(note*t)))]
 #define NOTE_LOOKUP(t,voice,note) \
         (((double)(SAMPLE_WAVETABLE(t,voice,note)) \
         / BITS_PER_NOTE ) * 2.0 - 1.0 ) * 0.90
 #define ONE_NOTE(t,note)    ( 0.99999*SQUARE(note*MML_PI_twice*t) )
+#define BITS_PER_NOTE_32        31.0
+
+/*  parse-time note storage. notes from every track are appended to a
+ *  list of chunks in the order they're parsed, each chunk twice the size
+ *  of the last, so nothing is ever reallocated or copied until the notes
+ *  are placed once into the finished song's block */
+#define MML_ARENA_FIRST_CHUNK   256
+
+typedef struct {
+    mml_note_t note;
+    unsigned int track;
+} mml__arena_note_t;
+
+typedef struct mml__arena_chunk_t {
+    struct mml__arena_chunk_t * next;
+    unsigned int count;
+    unsigned int capacity;
+    /* mml__arena_note_t notes[capacity] follows */
+} mml__arena_chunk_t;
+
+typedef struct {
+    mml__arena_chunk_t * first;
+    mml__arena_chunk_t * last;
+    unsigned int note_count;
+    int out_of_memory;
+} mml__arena_t;
+
+#define MML__ARENA_NOTES(c)     ((mml__arena_note_t*)((c)+1))
+
+/* a 't' command, the tick it was read at and its tempo */
+typedef struct {
+    uint32_t tick;
+    unsigned int bpm;
+    unsigned int slot;          /* of the track it's in */
+    unsigned int order;         /* read after order others, the later wins */
+} mml__tempo_t;
+
+/*  the most tempo changes a song keeps, later ones are dropped. loops
+ *  play the changes inside them again in every pass and nested ones could
+ *  multiply them without end */
+#define MML__MAX_TEMPOS         65536
+
+/* the '[' loops still open in one track */
+typedef struct {
+    uint32_t open[MML_MAX_LOOP_DEPTH];  /* tick each one started at */
+    unsigned int tempo_first[MML_MAX_LOOP_DEPTH];   /* tempo changes read before it */
+    unsigned int tempos;        /* bit d, loop d has a 't' inside */
+    unsigned int depth;
+    unsigned int ignored;       /* '['s nested past MML_MAX_LOOP_DEPTH */
+    unsigned int deepest;       /* most loops and patterns nested at once */
+} mml__loop_state_t;
+
+/* a '$n{ ... }' definition, in the order they're read */
+typedef struct {
+    int id;                     /* the n in $n */
+    unsigned int slot;          /* where its records are parsed to */
+    uint32_t ticks;
+    unsigned int depth;         /* its loop state's deepest */
+} mml__pattern_def_t;
 
-static const char* mml_buf = NULL;
-static unsigned int mml_index = 0;
-static double mml_sequence_counter = 0.0;
+/*  a track segment, the text from one ';' up to and including the next,
+ *  as noted by a parser for live editing (see mml_edit_apply). it can be
+ *  parsed again on its own from the state its track is in at its start.
+ *  an edit keeps begin, end, first and ticks_in relative to how far it
+ *  has moved them (see mml__edit_seg) */
+typedef struct {
+    unsigned int begin;         /* bytes of the text */
+    unsigned int end;
+    int ended;                  /* by a ';', only the last one isn't */
+    int global;                 /* did anything outside its own track */
+    unsigned int track;
+    unsigned int patterns;      /* definitions read before it */
+    unsigned int first;         /* its first record in the track */
+    unsigned int records;
+    uint32_t ticks_in;          /* the track's length at its start */
+    uint32_t ticks;
+    mml_read_state_t rs_in, rs_out;
+    mml__loop_state_t loops_in, loops_out;
+    unsigned int nth;           /* segments of its track before it */
+    unsigned int next;          /* its track's next segment, or the count */
+} mml__segment_t;
+
+/*  the end of a command cut off between two fed chunks is kept here.
+ *  runs of whitespace are shortened (see mml__carry_append), so the
+ *  longest command (a note with a sign and a fraction) always fits */
+#define MML__CARRY_SIZE         64
+
+/* lexer/parser state for mml_open_mem or a song fed in pieces, nothing is
+ * shared between parsers so songs can be parsed on several threads at once */
+struct mml_parser_t {
+    const char * buf;           /* the chunk, or the carry, being read */
+    unsigned int index;
+    unsigned int size;
+    int final;                  /* buf ends the text */
+    int starved;                /* something read past the end of a chunk */
+    int stopped;                /* a NUL between commands ended the text */
+    int in_token;               /* skipping to the next command */
+    int in_comment;             /* skipping a // comment */
+    char carry[MML__CARRY_SIZE];
+    unsigned int carry_count;
+    uint32_t sequence_counter;  /* ticks into the current measure */
+    mml__arena_t arena;
+
+    /* tracks and patterns are each read into a slot of the per slot
+     * arrays (rs, loops, ms_length, lengths) in the order they appear */
+    mml_song_t data;
+    int wave_define;
+    int current_track;
+    int cur;                    /* slot being read into, -1 before any 'w' */
+    mml_read_state_t * rs;
+    mml__loop_state_t * loops;
+    uint32_t * ms_length;
+    unsigned int * lengths;
+    unsigned int * track_slots;
+    mml__tempo_t * tempos;
+    mml__pattern_def_t * patterns;
+    int defining;               /* pattern being read */
+    unsigned int ignored_braces;
+    uint32_t track_counter;     /* the track's sequence counter meanwhile */
+
+    int log_segments;           /* note each track segment in segments */
+    int one_segment;            /* stop at the end of the first */
+    mml__segment_t * segments;
+};
+
+/* bounds checked reads, anything past the end of the span reads as
+ * NULLCHAR so the buffer needs no terminator and is never written. past
+ * the end of a chunk that isn't the last it marks the parser starved */
+#define MML__PAST_END(p)    ( (p)->starved |= !(p)->final, NULLCHAR )
+#define MML__PEEK(p,k)  ( (p)->index+(k) < (p)->size \
+                            ? (p)->buf[(p)->index+(k)] : MML__PAST_END(p) )
+#define MML__GETC(p)    ( (p)->index < (p)->size \
+                            ? (p)->buf[(p)->index++] : ((p)->index++, MML__PAST_END(p)) )
+
+/*  character classes for the lexer, one lookup per byte instead of a
+ *  chain of compares */
+#define MML__CC_SPACE   1       /* ' ', '\t' and '\n' */
+#define MML__CC_DIGIT   2
+#define MML__CC_TOKEN   4       /* returned by mml__get_token_s */
 
-void mml__skipwhite_and_nums_s()
+static const unsigned char mml__char_class[256] = {
+    4,0,0,0,0,0,0,0,0,1,1,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,0,0,4,0,0,0,0,0,0,0,0,0,0,4,
+    2,2,2,2,2,2,2,2,2,2,0,4,4,0,4,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,4,0,0,0,
+    4,0,0,0,0,0,0,0,0,0,0,4,0,4,0,0,
+    0,4,4,4,4,4,4,4,0,0,0,0,4,0,0,4,
+    4,4,4,0,4,0,4,4,0,0,0,0,0,4,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+#define MML__CLASS(p)   ( (p)->index < (p)->size \
+                            ? mml__char_class[(unsigned char)(p)->buf[(p)->index]] \
+                            : (MML__PAST_END(p), MML__CC_TOKEN) )
+
+/*  how many of the n bytes at s are whitespace (and digits, if classes
+ *  has MML__CC_DIGIT), 16 at a time where there are vectors */
+unsigned int mml__span_class(const char* s,unsigned int n,int classes)
 {
-    int c;
-    while(  (c = mml_buf[mml_index++]) == ' ' 
-            || c == '\n'
-            || c == '\t'
-            || (c < 58 && c > 47)   )
-        ;                       /* discard whitespace and spurious numbers */
-    mml_index--;
+    unsigned int i = 0;
+#if defined(MML__SIMD_X86) && defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    __m128i v,m,d;
+    unsigned int mask;
+    for( ; i+16<=n; i+=16 )
+    {
+        v = _mm_loadu_si128((const __m128i*)(s+i));
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,space),_mm_cmpeq_epi8(v,tab)),
+                         _mm_cmpeq_epi8(v,newline));
+        if( classes & MML__CC_DIGIT )
+        {
+            /* '0'..'9' are the bytes whose distance from '0' is at most 9 */
+            d = _mm_sub_epi8(v,zero);
+            m = _mm_or_si128(m,_mm_cmpeq_epi8(_mm_min_epu8(d,nine),d));
+        }
+        mask = (unsigned int)_mm_movemask_epi8(m);
+        if( mask != 0xffff )
+            return i + (unsigned int)__builtin_ctz(~mask);
+    }
+#elif defined(MML__SIMD_NEON) && defined(__aarch64__)
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    const uint8x16_t zero = vdupq_n_u8('0');
+    const uint8x16_t nine = vdupq_n_u8(9);
+    uint8x16_t v,m;
+    /* whole vectors only, the loop below finds where a run ends */
+    for( ; i+16<=n; i+=16 )
+    {
+        v = vld1q_u8((const uint8_t*)(s+i));
+        m = vorrq_u8(vorrq_u8(vceqq_u8(v,space),vceqq_u8(v,tab)),vceqq_u8(v,newline));
+        if( classes & MML__CC_DIGIT )
+            m = vorrq_u8(m,vcleq_u8(vsubq_u8(v,zero),nine));
+        if( vminvq_u8(m) != 0xff )
+            break;
+    }
+#endif
+    while( i < n && (mml__char_class[(unsigned char)s[i]] & classes) )
+        i++;
+    return i;
 }
 
-void mml__skipwhite_s()
+/*  skips bytes of the given classes. most runs are a few bytes and go by
+ *  a lookup at a time as before, only once a run reaches MML__LONG_RUN
+ *  (indentation, padding, blank lines) is the rest handed to
+ *  mml__span_class, shorter than that the vectors cost more than they save */
+#define MML__LONG_RUN   8
+
+void mml__skip_class(mml_parser_t* p,int classes)
 {
-    int c;
-    while(  (c = mml_buf[mml_index++]) == ' ' 
-            || c == '\n'
-            || c == '\t'   )
-        ;                       /* discard whitespace */
-    mml_index--;
+    unsigned int run = 0;
+    while( MML__CLASS(p) & classes )
+    {
+        if( ++run == MML__LONG_RUN )
+            p->index += mml__span_class(p->buf+p->index,p->size-p->index,classes);
+        else
+            p->index++;
+    }
 }
 
-void mml__skipline_s()
+void mml__skipwhite_and_nums_s(mml_parser_t* p)
 {
-    int c;
-    while(  (c = mml_buf[mml_index++]) != '\n'
-            && c != NULLCHAR     )
-        ;                       /* discard current line */
-    if( c == NULLCHAR ) mml_index--;
+    /* discard whitespace and spurious numbers */
+    if( MML__CLASS(p) & (MML__CC_SPACE | MML__CC_DIGIT) )
+        mml__skip_class(p,MML__CC_SPACE | MML__CC_DIGIT);
 }
 
+void mml__skipwhite_s(mml_parser_t* p)
+{
+    /* discard whitespace */
+    if( MML__CLASS(p) & MML__CC_SPACE )
+        mml__skip_class(p,MML__CC_SPACE);
+}
 
-int mml__get_token_s()
+/* skips to the next command character, long runs of whitespace and
+ * digits (most of what's between commands) a vector at a time */
+void mml__skip_to_token(mml_parser_t* p)
 {
-    int c;
-    mml__skipwhite_and_nums_s();
-    while( 1 ) 
-    {
-        c = mml_buf[mml_index++];
-        
-        switch( c ) {
-            case 'a':   /* notes --         */
-            case 'b':
-            case 'c':
-            case 'd':
-            case 'e':
-            case 'f':
-            case 'g':
-            case 'r':
-            case 'p':
-            case 'o':   /* state mods --    */
-            case 'v':
-            case 'l':
-            case 'q':
-            case '<':
-            case '>':
-            case 'w':
-            case ';':   /* track finish     */
-            case '/':   /* comment          */
-            case NULLCHAR:
-                return c;
-                break;
-            default:
-                break;
+    unsigned int run = 0;
+    while( !(MML__CLASS(p) & MML__CC_TOKEN) )
+    {
+        if( ++run >= MML__LONG_RUN )
+        {
+            p->index += mml__span_class(p->buf+p->index,p->size-p->index,
+                                        MML__CC_SPACE | MML__CC_DIGIT);
+            run = 0;
+        }
+        else
+            p->index++;
+    }
+}
+
+/*  discards the current line up to and including its '\n', stopping short
+ *  of a NUL like the end of the buffer. in_comment stays set while the
+ *  line goes on past the end of the chunk. memchr is vectorised in any
+ *  libc worth using, so long comments go by a vector at a time */
+void mml__skipline_s(mml_parser_t* p)
+{
+    const char * line = p->buf + p->index;
+    const char * c;
+    unsigned int n;
+
+    if( p->index >= p->size )
+        return;
+    n = p->size - p->index;
+    if( (c = (const char*)memchr(line,'\n',n)) != NULL )
+    {
+        n = (unsigned int)(c - line) + 1;
+        p->in_comment = 0;
+    }
+    if( (c = (const char*)memchr(line,NULLCHAR,n)) != NULL )
+    {
+        n = (unsigned int)(c - line);
+        p->in_comment = 0;
+    }
+    p->index += n;
+}
+
+/*  skips to the next command character and returns it, NULLCHAR at the
+ *  end of the buffer. anything the parser has no use for is skipped */
+int mml__get_token_s(mml_parser_t* p)
+{
+    if( !(MML__CLASS(p) & MML__CC_TOKEN) )
+        mml__skip_to_token(p);
+    return MML__GETC(p);
+}
+
+void mml__arena_push(mml__arena_t* a,unsigned int track,mml_note_t note)
+{
+    mml__arena_chunk_t * c = a->last;
+    unsigned int cap;
+    if( c == NULL || c->count == c->capacity )
+    {
+        cap = c ? c->capacity*2 : MML_ARENA_FIRST_CHUNK;
+        c = (mml__arena_chunk_t*)MML_MALLOC(sizeof(mml__arena_chunk_t)
+                                            + sizeof(mml__arena_note_t)*cap);
+        if( c == NULL )
+        {
+            a->out_of_memory = 1;
+            return;
         }
-        mml__skipwhite_and_nums_s();
+        c->next = NULL;
+        c->count = 0;
+        c->capacity = cap;
+        if( a->last )
+            a->last->next = c;
+        else
+            a->first = c;
+        a->last = c;
+    }
+    MML__ARENA_NOTES(c)[c->count].note = note;
+    MML__ARENA_NOTES(c)[c->count].track = track;
+    c->count++;
+    a->note_count++;
+}
+
+/* the 32 bit argument of a control record */
+#define MML__ARG(n)     ( (uint32_t)(n).length | (uint32_t)(n).gate << 16 )
+
+void mml__set_arg(mml_note_t* n,uint32_t arg)
+{
+    n->length = (uint16_t)(arg & 0xffff);
+    n->gate = (uint16_t)(arg >> 16);
+}
+
+/* a loop, call or return record */
+mml_note_t mml__record(unsigned char pitch,unsigned char volume,uint32_t arg)
+{
+    mml_note_t r;
+    mml__set_arg(&r,arg);
+    r.pitch = pitch;
+    r.volume = volume;
+    r.depth = 0;
+    r.pan = MML_PAN_CENTER;
+    return r;
+}
+
+/*  appends a note of length ticks that sounds for the first gate of them,
+ *  or a rest with a gate of 0. anything longer than MML_NOTE_MAX_TICKS is
+ *  split into records that play back the same as one */
+void mml__push_note(mml__arena_t* a,unsigned int slot,unsigned int* count,
+                    uint32_t length,uint32_t gate,unsigned char pitch,
+                    unsigned char volume,unsigned char pan)
+{
+    mml_note_t note = mml__record(pitch,volume,0);
+    note.pan = pan;
+    do {
+        note.length = length < MML_NOTE_MAX_TICKS ? length : MML_NOTE_MAX_TICKS;
+        note.gate = gate < note.length ? gate : note.length;
+        mml__arena_push(a,slot,note);
+        (*count)++;
+        length -= note.length;
+        gate -= note.gate;
+    } while( length > 0 );
+}
+
+void mml__arena_free(mml__arena_t* a)
+{
+    mml__arena_chunk_t * c = a->first;
+    mml__arena_chunk_t * next;
+    while( c )
+    {
+        next = c->next;
+        MML_FREE(c);
+        c = next;
+    }
+    a->first = a->last = NULL;
+    a->note_count = 0;
+}
+
+/* closes the loops still open in slot, they play once */
+void mml__close_loops(mml__arena_t* a,unsigned int slot,mml__loop_state_t* ls,
+                      unsigned int* length)
+{
+    mml_note_t mark = mml__record(MML_PITCH_LOOP_END,1,0);
+    for( ; ls->depth > 0; ls->depth-- )
+    {
+        mml__arena_push(a,slot,mark);
+        (*length)++;
     }
+    ls->tempos = 0;
+}
+
+/*  a loop of n passes body ticks long plays the tempo changes its track
+ *  made inside it, the ones read since the first, again in each later
+ *  pass, as n written out copies of it would */
+void mml__repeat_tempos(mml_parser_t* p,unsigned int first,uint32_t body,int n)
+{
+    mml__tempo_t tempo;
+    unsigned int i,j,last = sb_count(p->tempos);
+    int c;
+
+    for( c=1; c<n; c++ )
+        for( i=first; i<last; i++ )
+        {
+            if( p->tempos[i].slot != (unsigned int)p->cur )
+                continue;
+            if( (j = sb_count(p->tempos)) >= MML__MAX_TEMPOS )
+                return;
+            tempo = p->tempos[i];
+            tempo.tick += c*body;
+            tempo.order = j;
+            sb_push(p->tempos,tempo);
+        }
+}
+
+/* finishes the pattern being read into its slot, the sequence counter
+ * holds its length */
+void mml__end_pattern(mml_parser_t* p,mml__pattern_def_t* def,
+                      mml__loop_state_t* ls,unsigned int* length)
+{
+    mml__close_loops(&p->arena,def->slot,ls,length);
+    mml__arena_push(&p->arena,def->slot,mml__record(MML_PITCH_RETURN,0,0));
+    (*length)++;
+    def->ticks = p->sequence_counter;
+    def->depth = ls->deepest;
 }
 
 int mml__clamp(int i, int min, int max)
@@ -425,80 +1093,53 @@ double mml__modf(double n)
     return (n - (int)n);
 }
 
-int mml__get_note_modifier_s() {
+int mml__get_note_modifier_s(mml_parser_t* p) {
     int result = NONE;
     int c;
-    mml__skipwhite_s();
+    mml__skipwhite_s(p);
     
-    c = mml_buf[mml_index++];
+    c = MML__GETC(p);
     
     if( c == '+' )
         result = PLUS;
     else if( c == '-' )
         result = MINUS;
     else
-        mml_index--;
+        p->index--;
     
     return result;
 }
 
-int mml__ipow(int b,int p)
-{
-    int n = 1;
-    int r = b;
-    if( p == 0 )
-        return 1;
-    else
-    {
-        assert( p>0 );
-        while( n<p )
-        {
-            r *= b;
-            ++n;
-        }
-    }
-    return r;
-}
-
-int mml__get_num_modifier_s()
+/* a number of up to 4 digits, or -1 if there isn't one */
+int mml__get_num_modifier_s(mml_parser_t* p)
 {
-    mml__skipwhite_s();
-    int c,i;
     int sum = 0;
     int count = 0;
-    int nums[4];
     
-    while(      (c = mml_buf[mml_index++]) < 58      /* tests ascii val of c */
-            &&  c > 47
-            &&  count < 4                       )
+    mml__skipwhite_s(p);
+    while( count < 4 && (MML__CLASS(p) & MML__CC_DIGIT) )
     {
-        nums[count++] = c-48;           /* convert from ascii val to a number */
-        sum = 0;
-        for( i=0; i<count; i++ )
-        {
-            sum += (nums[count-i-1] * (int)mml__ipow(10,i));
-        }
+        sum = sum*10 + (p->buf[p->index++] - '0');
+        count++;
     }
     
-    mml_index--;
-    
     if( count > 0 )
         return sum;
     else
         return -1;
 }
 
-double mml__get_note_length_s(int &ni)
+double mml__get_note_length_s(mml_parser_t* p,int &ni)
 {
    int n,d;
  
-   n = mml__get_num_modifier_s();
+   n = mml__get_num_modifier_s(p);
    
-   if(   mml_buf[mml_index] == '/' &&
-         mml_buf[mml_index+1] != '/' )
+   if(   MML__PEEK(p,0) == '/' &&
+         MML__PEEK(p,1) != '/' )
    {  /* slash present, treat n as a numerator */
-      mml_index += 1;
-      d = mml__get_num_modifier_s();
+      p->index += 1;
+      d = mml__get_num_modifier_s(p);
       if( n < 0 )
       {  /* no n, default to 1 */
          ni = d;
@@ -525,6 +1166,14 @@ double mml__get_note_length_s(int &ni)
    }
 }
 
+/* a length in whole notes as ticks, rounded to the nearest */
+uint32_t mml__ticks(double wholes)
+{
+    if( !(wholes > 0.0) )
+        return 0;
+    return (uint32_t)floor(wholes*MML_TICKS_PER_WHOLE + 0.5);
+}
+
 NOTE mml__fetch_note(int note,int mod)
 {
     switch( note ) {
@@ -559,16 +1208,30 @@ NOTE mml__fetch_note(int note,int mod)
 }
 
 
+/*  reads a whole file into a NUL terminated buffer, returns NULL if it
+ *  can't be opened or read */
 const char* mml__read_file(const char* fn,unsigned int* sz)
 {
     FILE* f = fopen(fn, "rb");
-    assert( f != NULL );
+    if( f == NULL )
+        return NULL;
     fseek(f, 0, SEEK_END);
     long fsize = ftell(f);
     rewind(f);
 
-    char* string = (char*)malloc(fsize + 1);
-    fread(string, fsize, 1, f);
+    /* ftell fails with -1, and gives nonsense for a directory */
+    char* string = fsize < 0 || (unsigned long)fsize >= 0xffffffffUL
+                 ? NULL : (char*)MML_MALLOC(fsize + 1);
+    if( string != NULL && fsize > 0 && fread(string, fsize, 1, f) != 1 )
+    {
+        MML_FREE(string);
+        string = NULL;
+    }
+    if( string == NULL )
+    {
+        fclose(f);
+        return NULL;
+    }
     fclose(f);
 
     string[fsize] = 0;
@@ -579,295 +1242,3466 @@ const char* mml__read_file(const char* fn,unsigned int* sz)
     return (const char*)string;
 }
 
-void mml_reset_decode_state(mml_t* m)
+#ifndef MML_NO_MMAP
+/*  maps a whole file read-only, returns NULL if it can't be mapped
+ *  (missing, empty, or mapping unsupported) */
+const char* mml__map_file(const char* fn,unsigned int* sz)
 {
-   int i,j;
-   for( i=0; i<m->data.track_count; i++ )
-   {
-      /* zero track positions */
-      m->decode_state.track_pos[i] = 0;
-      /* set initial notes to 0 */
-      int n = sb_count(m->data.tracks[i]);
-      for( j=0; j<n; j++ )
-      {
-         m->data.tracks[i][j].accum_time = 0.0;
-      }
-   }
-    /* zero total track time */
-    m->decode_state.accum_time = 0.0;
-    
+    const char* buf = NULL;
+#ifdef _WIN32
+    HANDLE f,fm;
+    LARGE_INTEGER fsize;
+    f = CreateFileA(fn,GENERIC_READ,FILE_SHARE_READ,NULL,
+                    OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+    if( f == INVALID_HANDLE_VALUE )
+        return NULL;
+    if( GetFileSizeEx(f,&fsize) && fsize.QuadPart > 0 )
+    {
+        fm = CreateFileMappingA(f,NULL,PAGE_READONLY,0,0,NULL);
+        if( fm )
+        {   /* the view keeps the mapping alive after the handles close */
+            buf = (const char*)MapViewOfFile(fm,FILE_MAP_READ,0,0,0);
+            CloseHandle(fm);
+        }
+        *sz = (unsigned int)fsize.QuadPart;
+    }
+    CloseHandle(f);
+#else
+    struct stat st;
+    void* addr;
+    int fd = open(fn,O_RDONLY);
+    if( fd < 0 )
+        return NULL;
+    if( fstat(fd,&st) == 0 && st.st_size > 0 )
+    {
+        addr = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if( addr != MAP_FAILED )
+            buf = (const char*)addr;
+        *sz = (unsigned int)st.st_size;
+    }
+    close(fd);
+#endif
+    return buf;
 }
 
-double mml_decode_stream(mml_t* m,double dt)
+void mml__unmap_file(const char* buf,unsigned int sz)
 {
-    int i,j;
-    double r,v,vn,c;
-    mml_note_t * n;
-    r = 0.0;
-    v = m->data.volume;
-    
-    m->decode_state.accum_time += dt;
-    /* check if we reached the end of the song */
-    if( m->decode_state.accum_time > m->data.length )
-    {
-        dt = m->decode_state.accum_time - m->data.length;
-        mml_reset_decode_state(m);
-        m->decode_state.accum_time += dt;
-    }
-        
-    for( i=0; i<m->data.track_count; ++i )
+#ifdef _WIN32
+    (void)sz;
+    UnmapViewOfFile(buf);
+#else
+    munmap((void*)buf,sz);
+#endif
+}
+#endif /* MML_NO_MMAP */
+
+#define MML__RESYNC_PHASE       1   /* restart phases from the sample position */
+#define MML__RESYNC_SEEK        2   /* seek_time must be turned into a position */
+#define MML__RESYNC_EVENTS      4   /* note_end and voices are out of date */
+
+/* note k covers ticks [starts[k], MML__NOTE_END(s,k)) of its track, plus
+ * the track's tick_shift */
+#define MML__NOTE_END(s,k)      ((s)->starts[k] + (s)->notes[k].length)
+
+/* loop, call and return records, everything else is a note or rest */
+#define MML__IS_CONTROL(pitch)  ( (pitch) >= MML_PITCH_RETURN \
+                                    && (pitch) <= MML_PITCH_LOOP_BEGIN )
+
+/* ticks pattern n plays for, the start of its return record */
+#define MML__PATTERN_TICKS(s,n) \
+        ( (s)->starts[(s)->pattern_offsets[n] + (s)->pattern_lengths[n] - 1] )
+
+/* the tick record k ends at, a call ends with its pattern and the other
+ * control records take no time themselves */
+#define MML__RECORD_END(s,k) \
+        ( (s)->notes[k].pitch == MML_PITCH_CALL \
+            ? (s)->starts[k] + MML__PATTERN_TICKS(s,MML__ARG((s)->notes[k])) \
+            : MML__IS_CONTROL((s)->notes[k].pitch) \
+                ? (s)->starts[k] : MML__NOTE_END(s,k) )
+
+/* ticks in one pass through the loop from record b to record e */
+#define MML__LOOP_BODY(s,b,e)   ( ((s)->starts[e] - (s)->starts[b]) / (s)->notes[e].volume )
+
+/*  takes track i through any control records from record k on and
+ *  returns the first note it comes to, or the end of the track. a loop
+ *  that goes round again jumps back to its first record with the track's
+ *  ticks shifted one pass on, so repeats cost nothing but a counter. a
+ *  call shifts the ticks to where it starts and keeps the record to come
+ *  back to in the same stack. patterns are stored before every track so
+ *  k only meets end in the track itself */
+unsigned int mml__track_follow(mml_player_t* p,unsigned int i,unsigned int k)
+{
+    const mml_song_t* s = p->song;
+    const unsigned int end = s->track_offsets[i] + s->track_lengths[i];
+    uint32_t * count = p->loop_counts + i*MML_MAX_LOOP_DEPTH;
+    unsigned int b;
+    uint32_t body;
+
+    while( k != end )
     {
-        j = m->decode_state.track_pos[i];
-        n = &m->data.tracks[i][j];
-        if( j == sb_count(m->data.tracks[i]) )
-            continue;
-        else if( n->accum_time+dt > n->length )
+        if( s->notes[k].pitch == MML_PITCH_CALL )
         {
-            dt = (n->accum_time+dt) - n->length;
-            j++;
-            m->decode_state.track_pos[i] = j;
-            if( j == sb_count(m->data.tracks[i]) )
-                continue;
-            n = &m->data.tracks[i][j];
-            n->accum_time = dt;
+            count[p->loop_depth[i]++] = k+1;
+            p->tick_shift[i] += s->starts[k];
+            k = s->pattern_offsets[MML__ARG(s->notes[k])];
         }
-        else
-            n->accum_time += dt;
-        
-        if( n->frequency )
+        else if( s->notes[k].pitch == MML_PITCH_RETURN )
+        {
+            k = count[--p->loop_depth[i]];
+            p->tick_shift[i] -= s->starts[k-1];
+        }
+        else if( s->notes[k].pitch == MML_PITCH_LOOP_BEGIN )
+        {
+            count[p->loop_depth[i]++] = 0;
+            k++;
+        }
+        else if( s->notes[k].pitch == MML_PITCH_LOOP_END )
         {
-           vn = n->volume;
-           c = NOTE_LOOKUP(m->decode_state.accum_time,m->data.waves[i],n->frequency);
-            
-           r += (v*vn*c);
+            b = k - MML__ARG(s->notes[k]);
+            body = MML__LOOP_BODY(s,b,k);
+            if( ++count[p->loop_depth[i]-1] < s->notes[k].volume )
+            {
+                p->tick_shift[i] += body;
+                k = b+1;
+            }
+            else
+            {
+                /* what follows the loop already counts every pass */
+                p->tick_shift[i] -= body*(s->notes[k].volume-1);
+                p->loop_depth[i]--;
+                k++;
+            }
         }
+        else
+            break;
     }
-    
-    return r;
+    return k;
 }
 
+void mml_player_reset(mml_player_t* p)
+{
+   const mml_song_t* s = p->song;
+   int i;
+   /* notes are never written while decoding, so a reset only has to
+    * rewind each track's cursor */
+   for( i=0; i<s->track_count; i++ )
+   {
+      p->tick_shift[i] = 0;
+      p->loop_depth[i] = 0;
+      p->track_pos[i] = mml__track_follow(p,i,s->track_offsets[i])
+                      - s->track_offsets[i];
+      p->phase[i] = 0;
+   }
+    /* back to the first sample */
+    p->pos = 0;
+    p->frac = 0.0;
+    p->resync = MML__RESYNC_PHASE | MML__RESYNC_EVENTS;
+}
 
+/*  the tempo map entry tick t falls in */
+unsigned int mml__tempo_at(const mml_song_t* s,uint32_t t)
+{
+    unsigned int lo = 0, hi = s->tempo_count, mid;
+    while( hi-lo > 1 )
+    {
+        mid = lo + (hi-lo)/2;
+        if( s->tempo_ticks[mid] <= t )
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
+/* seconds per tick at bpm, a whole note is 4 beats */
+#define MML__TICK_SECONDS(bpm)  (240.0/((double)(bpm)*MML_TICKS_PER_WHOLE))
 
-void mml_free(mml_t* m)
+double mml__tick_seconds(const mml_song_t* s,uint32_t t)
 {
-    int i;
-    for( i=0; i<m->data.track_count; i++ )
-        sb_free(m->data.tracks[i]);
-    sb_free(m->data.tracks);
-    sb_free(m->decode_state.track_pos);
-    
-    free(m);
+    unsigned int i = mml__tempo_at(s,t);
+    return s->tempo_seconds[i]
+         + (double)(t - s->tempo_ticks[i])*MML__TICK_SECONDS(s->tempo_bpm[i]);
 }
 
+/*  sample positions are 32 bits, a bit over 27 hours at 44.1 kHz. ticks
+ *  can run further than that (a slow tempo, loops inside loops), those
+ *  songs are cut off at the last sample: every tick past it maps to it, so
+ *  the order of events is kept and the song ends and loops there */
+#define MML__LAST_SAMPLE        0xffffffffu
 
-
-mml_t* mml_open_file(const char* filename)
+/*  the first sample at or after tick t, sample n plays at n/rate seconds.
+ *  note k covers samples [mml__tick_sample(start), mml__tick_sample(end)),
+ *  only worked out when a note starts so tempo costs nothing per sample */
+uint32_t mml__tick_sample(const mml_song_t* s,double rate,uint32_t t)
 {
-    if( mml_buf )
-        free((void*)mml_buf);
-        
-    unsigned int sz;
-    mml_buf = mml__read_file(filename,&sz);
-    
-    mml_t* song = mml_open_mem(mml_buf,sz);
-    
-    return song;
+    unsigned int i = mml__tempo_at(s,t);
+    /* kept as one product over one divisor so a steady tempo whose ticks
+     * land on whole samples comes out exact */
+    double x = ceil(s->tempo_seconds[i]*rate
+                + (double)(t - s->tempo_ticks[i])*rate*240.0
+                    /((double)s->tempo_bpm[i]*MML_TICKS_PER_WHOLE));
+    return x < (double)MML__LAST_SAMPLE ? (uint32_t)x : MML__LAST_SAMPLE;
 }
 
-mml_t* mml_open_mem(const char* buf,unsigned int sz)
+/*  points track i at the note playing at sample pos, a binary search for
+ *  the first record that hasn't ended yet. records inside a loop end
+ *  where its first pass does, so landing on a loop's end record means pos
+ *  is in a later pass: another binary search picks the pass and the
+ *  search goes on inside its body. landing on a call goes on inside the
+ *  pattern, whose loop depths count from the call's */
+void mml__track_locate(mml_player_t* p,unsigned int i,uint32_t pos)
 {
-    int c;
-    double rest_len;
-    
-    mml_buf = buf;
-    mml_index = 0;
-    
-    mml_sequence_counter = 0;
-    
-    mml_t* song = (mml_t*)malloc(sizeof(mml_t));
-    song->data.beats_per_minute = 140;
-    song->data.length = 0.0;
-    song->data.tracks = NULL;
-    
-    song->data.track_count = 0;
-    song->decode_state.track_pos = NULL;
-    song->decode_state.accum_time = 0.0;
-    song->data.volume = 0.0;
-    song->data.waves = NULL;
-    
-    int wave_define = 1;
-    mml_read_state_t * rs = NULL;
-    double * ms_length = NULL;
-    
-    int current_track = 0;
-    int n,i,m;
-    double nl;
-    
-    /* main parser loop */
-   while( mml_buf[mml_index] != NULLCHAR && mml_index < sz )
-   {
-      c = mml__get_token_s();
-      switch( c ) {
-         case 'w': /* define wave */
-            if( wave_define )
-            {
-               song->data.track_count += 1;
-               current_track = song->data.track_count - 1;
-               
-               song->data.volume += 1.0;
-               
-               n = mml__get_num_modifier_s();
-               sb_push(song->data.waves,mml__clamp(n,0,NUM_VOICES-1));
-               
-               mml_read_state_t tmp;
-               tmp.note_length = .25;
-               tmp.hit_length = .75;
-               tmp.octave = 4;
-               tmp.volume = 1.0;
-               
-               sb_push(rs,tmp);
-               sb_push(ms_length,0.0);
-            }
-            break;
-         case '/':   /* comment */
-            if( (c = mml_buf[mml_index++]) == '/' )      /* check for follow '/' */
-                 mml__skipline_s();
-            break;
-         case ';':   /* end current track and start new track */
-         {
-            if( wave_define )
-            {  /* we finish defining waves and reset counters */
-               wave_define = 0;
-               current_track = 0;
-               mml_sequence_counter = 0.0;
-               
-               /* allocate pointers for parallel tracks */
-               sb_add(song->data.tracks,song->data.track_count);
-               for( i=0; i<song->data.track_count; i++ )
-                  song->data.tracks[i] = NULL;
-            }
+    const mml_song_t* s = p->song;
+    const unsigned int base = s->track_offsets[i];
+    const unsigned int end = base + s->track_lengths[i];
+    uint32_t * count = p->loop_counts + i*MML_MAX_LOOP_DEPTH;
+    unsigned int lo = base, hi = end, mid,k,b,d,outer = 0;
+    uint32_t c,c_lo,c_hi,body;
+
+    p->tick_shift[i] = 0;
+    p->loop_depth[i] = 0;
+    for( ;; )
+    {
+        while( lo < hi )
+        {
+            mid = lo + (hi-lo)/2;
+            if( mml__tick_sample(s,p->rate,MML__RECORD_END(s,mid)+p->tick_shift[i]) <= pos )
+                lo = mid+1;
             else
-            {
-               ms_length[current_track] += mml_sequence_counter;
-               mml_sequence_counter = 0.0;
-               
-               current_track += 1;
-               current_track %= song->data.track_count;
-            }
-         }
+                hi = mid;
+        }
+        k = lo;
+        if( k == end )
             break;
-         case 'l':   /* note length */
-         {
-            if( (n = mml__get_num_modifier_s()) > 0 )
-            {  
-               rs[current_track].note_length = 1.0/(double)n;
-            }
-         }
+
+        /* any loops k is inside are on their first pass */
+        for( d=p->loop_depth[i]; d<outer+s->notes[k].depth; d++ )
+            count[d] = 0;
+        p->loop_depth[i] = d;
+        if( !MML__IS_CONTROL(s->notes[k].pitch) )
             break;
-         case 'o':   /* note octave */
-             if( (n = mml__get_num_modifier_s()) != -1 )
-                 rs[current_track].octave = mml__clamp(n,0,8);
-             break;
-         case 'v':   /* note volume modifier */
-            if( (n = mml__get_num_modifier_s()) != -1 )
-               rs[current_track].volume = mml_quant_values[mml__clamp(n,0,8)];
+        if( s->notes[k].pitch == MML_PITCH_CALL
+            && MML__PATTERN_TICKS(s,MML__ARG(s->notes[k])) > 0 )
+        {
+            count[d] = k+1;
+            p->loop_depth[i] = outer = d+1;
+            p->tick_shift[i] += s->starts[k];
+            lo = s->pattern_offsets[MML__ARG(s->notes[k])];
+            hi = lo + s->pattern_lengths[MML__ARG(s->notes[k])];
+            continue;
+        }
+        if( s->notes[k].pitch != MML_PITCH_LOOP_END || s->notes[k].volume < 2 )
+        {
+            /* a loop or pattern that hasn't started yet, or an empty one */
+            if( s->notes[k].pitch == MML_PITCH_LOOP_END )
+                count[p->loop_depth[i]++] = s->notes[k].volume-1;
+            k = mml__track_follow(p,i,k);
             break;
-         case '<':   /* octave shift up */
-             rs[current_track].octave = mml__clamp(rs[current_track].octave+1,0,8);
-             break;
-         case '>':   /* octave shift dn */
-             rs[current_track].octave = mml__clamp(rs[current_track].octave-1,0,8);
-             break;
-         case 'q':   /* note hit length */
-             if( (n = mml__get_num_modifier_s()) != -1 )
-                 rs[current_track].hit_length = mml_quant_values[mml__clamp(n,0,8)];
-             break;
-         case 'a':   /* notes */
-         case 'b':
-         case 'c':
-         case 'd':
-         case 'e':
-         case 'f':
-         case 'g':
-         case 'r':
-         case 'p':
-         {
-            m = mml__get_note_modifier_s();
-            i = mml__fetch_note(c,m);
-            nl = mml__get_note_length_s(n);
-             
-            mml_note_t note;
-            note.frequency = (i == -1) ? 0.0 : mml_note_frequencies[12*rs[current_track].octave+i];
-            note.length = ( nl < 0 ) ? rs[current_track].note_length : nl;
-            
-            mml_sequence_counter += note.length;
-            
-            if( n > 0 )
-               rest_len = (1.0-rs[current_track].hit_length)*(1.0/(double)n);
+        }
+
+        /* the last pass that started by pos */
+        p->loop_depth[i] = d+1;
+        b = k - MML__ARG(s->notes[k]);
+        body = MML__LOOP_BODY(s,b,k);
+        for( c_lo=1, c_hi=s->notes[k].volume-1; c_lo < c_hi; )
+        {
+            c = c_hi - (c_hi-c_lo)/2;
+            if( mml__tick_sample(s,p->rate,s->starts[b]+c*body+p->tick_shift[i]) <= pos )
+                c_lo = c;
             else
-               rest_len = (1.0-rs[current_track].hit_length)*(rs[current_track].note_length);
-            
-            note.length -= rest_len;
-            note.accum_time = 0.0;
-            note.volume = rs[current_track].volume;
-            sb_push(song->data.tracks[current_track],note);
-             
-            if(  rs[current_track].hit_length < 1.0 )
-            {
-               mml_note_t rest;
-               rest.frequency = 0.0;
-               rest.length = rest_len;
-               rest.accum_time = 0.0;
-               sb_push(song->data.tracks[current_track],rest);
-            }
-         }
-            break;
-         default:
-            break;
-        };
+                c_hi = c-1;
+        }
+        count[d] = c_lo;
+        p->tick_shift[i] += c_lo*body;
+        lo = b+1;
+        hi = k;
     }
-    
-   free((void*)mml_buf);
-   mml_buf = NULL;
-   mml_index = 0;
+    p->track_pos[i] = k - base;
+    p->phase[i] = 0;
+}
 
-   song->data.volume = 1.0/song->data.volume;
-   song->data.length = 0.0;
-   for( i=0; i<song->data.track_count; i++ )
+/*  points every track at the note playing at sample pos */
+void mml__player_locate(mml_player_t* p,uint32_t pos)
+{
+    unsigned int i;
+    for( i=0; i<p->song->track_count; i++ )
+        mml__track_locate(p,i,pos);
+    p->pos = pos;
+}
+
+/*  recomputes everything that depends on the sample rate, only happens
+ *  when the rate passed to the decoder changes. a position at the old rate
+ *  moves to the same song time at the new one, and the part of a sample
+ *  that doesn't land on is kept in frac so switching rates back and forth
+ *  doesn't drift */
+void mml__set_rate(mml_player_t* p,double sample_rate)
+{
+    const double old = p->rate;
+    int i;
+    double inc,x;
+
+    for( i=0; i<MML_PITCH_COUNT; i++ )
+    {
+        inc = GET_DECIMAL((double)mml_note_frequencies[i]/sample_rate);
+        p->pitch_inc[i] = (uint32_t)(inc*4294967296.0);
+    }
+    p->rate = sample_rate;
+    p->song_end = mml__tick_sample(p->song,sample_rate,p->song->length);
+    p->loop_start = mml__tick_sample(p->song,sample_rate,p->song->loop_tick);
+    if( p->loop_start >= p->song_end )
+        p->loop_start = 0;
+
+    if( old > 0.0 && !(p->resync & MML__RESYNC_SEEK) )
+    {
+        x = ((double)p->pos + p->frac)/old*sample_rate;
+        if( x < p->song_end )
+        {
+            p->pos = (uint32_t)x;
+            p->frac = x - p->pos;
+        }
+        else
+        {
+            /* the decoder goes round to the loop point from here */
+            p->pos = p->song_end;
+            p->frac = 0.0;
+        }
+        mml__player_locate(p,p->pos);
+        p->resync |= MML__RESYNC_PHASE | MML__RESYNC_EVENTS;
+    }
+}
+
+void mml_player_seek(mml_player_t* p,double seconds)
+{
+    /* the position depends on the sample rate, the decoder fills it in */
+    p->seek_time = seconds;
+    p->resync |= MML__RESYNC_SEEK;
+}
+
+/*  puts p exactly where it would be after decoding frame frames from the
+ *  start of the song at sample_rate, so rendering on from here gives the
+ *  same bits as rendering straight through */
+void mml__player_seek_frame(mml_player_t* p,unsigned int frame,double sample_rate)
+{
+    if( p->rate != sample_rate )
+        mml__set_rate(p,sample_rate);
+    mml__player_locate(p,frame);
+    p->frac = 0.0;
+    p->resync = MML__RESYNC_PHASE | MML__RESYNC_EVENTS;
+}
+
+/*  the phase modes play band-limited copies of the 16 and 32 step waves,
+ *  MML__MIP_SIZE points each, one per octave: level l keeps the harmonics
+ *  up to MML__MIP_TOP >> l, so a note reading the fullest level whose top
+ *  harmonic is under nyquist doesn't alias and costs the same lookup per
+ *  sample as the plain steps. they're shared by every player and built
+ *  once, the first time any player picks a phase mode */
+#define MML__MIP_BITS           9
+#define MML__MIP_SIZE           (1 << MML__MIP_BITS)
+#define MML__MIP_SHIFT          (32 - MML__MIP_BITS)
+#define MML__MIP_TOP            (MML__MIP_SIZE/2)
+#define MML__MIP_LEVELS         (MML__MIP_BITS)
+
+static float mml__mips[2][NUM_VOICES][MML__MIP_LEVELS][MML__MIP_SIZE];
+static uint32_t mml__mips_state = 0;   /* 0 unbuilt, 1 being built, 2 ready */
+
+/*  the fourier series of each wave as the steps it's written as, summed a
+ *  harmonic at a time and copied out as each level's top one is reached */
+void mml__build_mips(void)
+{
+    double sines[MML__MIP_SIZE];
+    double sum[MML__MIP_SIZE];
+    double v[32];
+    double a,b,dc;
+    unsigned int t,w,j,k,n,steps,ratio;
+    int l;
+
+    for( n=0; n<MML__MIP_SIZE; n++ )
+        sines[n] = sin(MML_PI_twice*n/MML__MIP_SIZE);
+    for( t=0; t<2; t++ )
+    {
+        steps = t ? 32 : 16;
+        ratio = MML__MIP_SIZE/steps;
+        for( w=0; w<NUM_VOICES; w++ )
+        {
+            dc = 0.0;
+            for( j=0; j<steps; j++ )
+            {
+                /* the same levels the steps were played at */
+                v[j] = t ? (((double)mml_wavetable_32[w][j] / BITS_PER_NOTE_32 ) * 2.0 - 1.0 ) * 0.90
+                         : (((double)mml_wavetable[w][j] / BITS_PER_NOTE ) * 2.0 - 1.0 ) * 0.90;
+                dc += v[j];
+            }
+            for( n=0; n<MML__MIP_SIZE; n++ )
+                sum[n] = dc/steps;
+            l = MML__MIP_LEVELS-1;
+            for( k=1; k<=MML__MIP_TOP; k++ )
+            {
+                /* step j holds v[j] over [j, j+1)/steps of the cycle */
+                a = b = 0.0;
+                for( j=0; j<steps; j++ )
+                {
+                    a += v[j]*(sines[(k*(j+1)*ratio) % MML__MIP_SIZE]
+                             - sines[(k*j*ratio) % MML__MIP_SIZE]);
+                    b += v[j]*(sines[(k*j*ratio + MML__MIP_SIZE/4) % MML__MIP_SIZE]
+                             - sines[(k*(j+1)*ratio + MML__MIP_SIZE/4) % MML__MIP_SIZE]);
+                }
+                a /= MML_PI*k;
+                b /= MML_PI*k;
+                for( n=0; n<MML__MIP_SIZE; n++ )
+                    sum[n] += a*sines[(k*n + MML__MIP_SIZE/4) % MML__MIP_SIZE]
+                            + b*sines[(k*n) % MML__MIP_SIZE];
+                if( l >= 0 && k == (MML__MIP_TOP >> l) )
+                {
+                    for( n=0; n<MML__MIP_SIZE; n++ )
+                        mml__mips[t][w][l][n] = (float)sum[n];
+                    l--;
+                }
+            }
+        }
+    }
+}
+
+/*  builds the tables on whichever thread gets here first, the others
+ *  wait for it, yielding their cores since it takes a few milliseconds.
+ *  after that it's one load */
+void mml__mips_init(void)
+{
+    uint32_t unbuilt = 0;
+    if( MML__LOAD_ACQUIRE(mml__mips_state) == 2 )
+        return;
+    if( MML__CAS32(mml__mips_state,unbuilt,1) )
+    {
+        mml__build_mips();
+        MML__STORE_RELEASE(mml__mips_state,2);
+    }
+    else
+        while( MML__LOAD_ACQUIRE(mml__mips_state) != 2 )
+            MML__YIELD();
+}
+
+/*  the level for a note stepping inc per sample, the fullest one whose
+ *  top harmonic stays under half the sample rate */
+const float* mml__wave_mip(unsigned int wave,int oscillator,uint32_t inc)
+{
+    unsigned int l = 0;
+    while( l < MML__MIP_LEVELS-1 && (uint64_t)inc*(MML__MIP_TOP >> l) > 0x80000000u )
+        l++;
+    return mml__mips[oscillator == MML_OSC_PHASE_16 ? 0 : 1][wave][l];
+}
+
+void mml_player_set_oscillator(mml_player_t* p,int mode)
+{
+    p->oscillator = mml__clamp(mode,MML_OSC_TIME,MML_OSC_PHASE_32);
+    if( p->oscillator != MML_OSC_TIME )
+        mml__mips_init();
+}
+
+/*  the phase modes mix a block one track at a time: each note covers a
+ *  span of samples over which its pitch, volume and wave don't change, so
+ *  the span is handed whole to a mixing kernel that adds
+ *  gain*levels[phase>>shift] into the block while stepping the phase.
+ *  the kernels below all do the same single precision multiply and add
+ *  per sample, in the same track order, so they agree with the scalar one
+ *  to within float rounding (a compiler contracting the scalar loop into
+ *  fused multiply-adds is the only source of difference, under 1e-6 per
+ *  track). the kernel is picked at run time from what the cpu supports,
+ *  define MML_NO_SIMD to always use the scalar one */
+typedef void (*mml__mix_fn)(float* out,unsigned int n,uint32_t phase,uint32_t inc,
+                            const float* levels,int shift,float gain);
+
+void mml__mix_scalar(float* out,unsigned int n,uint32_t phase,uint32_t inc,
+                     const float* levels,int shift,float gain)
+{
+    unsigned int x;
+    for( x=0; x<n; x++, phase+=inc )
+        out[x] += gain*levels[phase>>shift];
+}
+
+#ifdef MML__SIMD_X86
+#ifdef __SSE2__
+/* sse2 has no variable lookup, phases are stepped 4 wide and the table
+ * is read per lane */
+void mml__mix_sse2(float* out,unsigned int n,uint32_t phase,uint32_t inc,
+                   const float* levels,int shift,float gain)
+{
+    unsigned int x = 0;
+    uint32_t idx[4];
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    const __m128i step = _mm_set1_epi32((int)(inc*4));
+    const __m128 g = _mm_set1_ps(gain);
+    __m128i ph = _mm_setr_epi32((int)phase,(int)(phase+inc),
+                                (int)(phase+inc*2),(int)(phase+inc*3));
+    __m128 lv,o;
+
+    for( ; x+4<=n; x+=4 )
+    {
+        _mm_storeu_si128((__m128i*)idx,_mm_srl_epi32(ph,sh));
+        lv = _mm_setr_ps(levels[idx[0]],levels[idx[1]],levels[idx[2]],levels[idx[3]]);
+        o = _mm_add_ps(_mm_loadu_ps(out+x),_mm_mul_ps(g,lv));
+        _mm_storeu_ps(out+x,o);
+        ph = _mm_add_epi32(ph,step);
+    }
+    mml__mix_scalar(out+x,n-x,phase+inc*x,inc,levels,shift,gain);
+}
+#endif /* __SSE2__ */
+
+/* 8 samples at a time, the table read with a gather */
+__attribute__((target("avx2")))
+void mml__mix_avx2(float* out,unsigned int n,uint32_t phase,uint32_t inc,
+                   const float* levels,int shift,float gain)
+{
+    unsigned int x = 0;
+    const __m128i sh = _mm_cvtsi32_si128(shift);
+    const __m256i step = _mm256_set1_epi32((int)(inc*8));
+    const __m256 g = _mm256_set1_ps(gain);
+    __m256i ph = _mm256_add_epi32(_mm256_set1_epi32((int)phase),
+            _mm256_mullo_epi32(_mm256_set1_epi32((int)inc),
+                               _mm256_setr_epi32(0,1,2,3,4,5,6,7)));
+    __m256i idx;
+    __m256 lv,o;
+
+    for( ; x+8<=n; x+=8 )
+    {
+        idx = _mm256_srl_epi32(ph,sh);
+        lv = _mm256_i32gather_ps(levels,idx,4);
+        o = _mm256_add_ps(_mm256_loadu_ps(out+x),_mm256_mul_ps(g,lv));
+        _mm256_storeu_ps(out+x,o);
+        ph = _mm256_add_epi32(ph,step);
+    }
+    mml__mix_scalar(out+x,n-x,phase+inc*x,inc,levels,shift,gain);
+}
+#endif /* MML__SIMD_X86 */
+
+#ifdef MML__SIMD_NEON
+void mml__mix_neon(float* out,unsigned int n,uint32_t phase,uint32_t inc,
+                   const float* levels,int shift,float gain)
+{
+    unsigned int x = 0;
+    uint32_t idx[4];
+    const int32x4_t sh = vdupq_n_s32(-shift);
+    const uint32x4_t step = vdupq_n_u32(inc*4);
+    const uint32_t first[4] = { phase, phase+inc, phase+inc*2, phase+inc*3 };
+    uint32x4_t ph = vld1q_u32(first);
+    float32x4_t lv,o;
+    float l[4];
+
+    for( ; x+4<=n; x+=4 )
+    {
+        vst1q_u32(idx,vshlq_u32(ph,sh));
+        l[0] = levels[idx[0]];
+        l[1] = levels[idx[1]];
+        l[2] = levels[idx[2]];
+        l[3] = levels[idx[3]];
+        lv = vld1q_f32(l);
+        o = vaddq_f32(vld1q_f32(out+x),vmulq_n_f32(lv,gain));
+        vst1q_f32(out+x,o);
+        ph = vaddq_u32(ph,step);
+    }
+    mml__mix_scalar(out+x,n-x,phase+inc*x,inc,levels,shift,gain);
+}
+#endif /* MML__SIMD_NEON */
+
+mml__mix_fn mml__select_mix(void)
+{
+#if defined(MML__SIMD_X86)
+    if( __builtin_cpu_supports("avx2") )
+        return mml__mix_avx2;
+#ifdef __SSE2__
+    return mml__mix_sse2;
+#endif
+#elif defined(MML__SIMD_NEON)
+    return mml__mix_neon;
+#endif
+    return mml__mix_scalar;
+}
+
+/*  scratch size for MML_OSC_TIME, which sums in double before writing
+ *  floats out, and for a track's samples before they're panned */
+#define MML__SPAN_CHUNK         256
+
+/*  a pan from -1 (left) to 1 as gains for channels channels laid out
+ *  left to right, at constant power between the two it falls between */
+void mml__pan_gains(float* gains,unsigned int channels,double pan)
+{
+    unsigned int i,c;
+    double q,f;
+
+    if( pan < -1.0 ) pan = -1.0;
+    if( pan > 1.0 ) pan = 1.0;
+    q = (pan+1.0)*0.5*(channels-1);
+    c = (unsigned int)q;
+    if( c > channels-2 )
+        c = channels-2;
+    f = q - c;
+    for( i=0; i<channels; i++ )
+        gains[i] = 0.0f;
+    /* sin both ways, exactly 0 and 1 at the ends */
+    gains[c] = (float)sin((1.0-f)*MML_PI/2.0);
+    gains[c+1] = (float)sin(f*MML_PI/2.0);
+}
+
+/* where a note's 'P' and its track's pan put it, -1 to 1 */
+double mml__note_pan(const mml_player_t* p,unsigned int track,unsigned char pan)
+{
+    double x = pan < MML_PAN_CENTER
+             ? (pan - MML_PAN_CENTER)/(double)MML_PAN_CENTER
+             : (pan - MML_PAN_CENTER)/(double)(MML_PAN_MAX - MML_PAN_CENTER);
+    return x + p->pan[track];
+}
+
+/*  adds in[0..n) into n interleaved frames, times gains[c] in channel c.
+ *  stereo spreads each vector of 4 samples over 2 of frames, the same
+ *  multiply and add per sample as the plain loop */
+void mml__pan_add(float* out,const float* in,unsigned int n,unsigned int channels,
+                  const float* gains)
+{
+    unsigned int x = 0,c;
+#if defined(MML__SIMD_X86) && defined(__SSE2__)
+    const __m128 g = _mm_setr_ps(gains[0],gains[1],gains[0],gains[1]);
+    __m128 v;
+    if( channels == 2 )
+        for( ; x+4<=n; x+=4 )
+        {
+            v = _mm_loadu_ps(in+x);
+            _mm_storeu_ps(out+2*x,_mm_add_ps(_mm_loadu_ps(out+2*x),
+                                             _mm_mul_ps(g,_mm_unpacklo_ps(v,v))));
+            _mm_storeu_ps(out+2*x+4,_mm_add_ps(_mm_loadu_ps(out+2*x+4),
+                                               _mm_mul_ps(g,_mm_unpackhi_ps(v,v))));
+        }
+#elif defined(MML__SIMD_NEON)
+    const float gv[4] = { gains[0], gains[1], gains[0], gains[1] };
+    const float32x4_t g = vld1q_f32(gv);
+    float32x4x2_t z;
+    float32x4_t v;
+    if( channels == 2 )
+        for( ; x+4<=n; x+=4 )
+        {
+            v = vld1q_f32(in+x);
+            z = vzipq_f32(v,v);
+            vst1q_f32(out+2*x,vaddq_f32(vld1q_f32(out+2*x),vmulq_f32(g,z.val[0])));
+            vst1q_f32(out+2*x+4,vaddq_f32(vld1q_f32(out+2*x+4),vmulq_f32(g,z.val[1])));
+        }
+#endif
+    for( ; x<n; x++ )
+        for( c=0; c<channels; c++ )
+            out[x*channels+c] += gains[c]*in[x];
+}
+
+/*  each track keeps the sample its next event is at (note_end), where the
+ *  current note's gate or its whole length ends, worked out once when it
+ *  gets there. in between the track is just a span of samples with fixed
+ *  pitch, volume and wave, and nothing is compared per sample. anything
+ *  that moves the position without decoding marks it stale */
+
+/*  tracks that are resting, or past the gate of their note, wait in a
+ *  min-heap on the sample that ends before, so they cost nothing until
+ *  then */
+void mml__rest_push(mml_player_t* p,uint32_t track)
+{
+    uint32_t * h = p->resting;
+    unsigned int i,up;
+
+    for( i=p->rest_count++; i>0; i=up )
+    {
+        up = (i-1)/2;
+        if( p->note_end[h[up]] <= p->note_end[track] )
+            break;
+        h[i] = h[up];
+    }
+    h[i] = track;
+}
+
+uint32_t mml__rest_pop(mml_player_t* p)
+{
+    uint32_t * h = p->resting;
+    uint32_t top = h[0];
+    uint32_t moved = h[--p->rest_count];
+    unsigned int i,c;
+
+    for( i=0; (c = 2*i+1) < p->rest_count; i=c )
+    {
+        if( c+1 < p->rest_count && p->note_end[h[c+1]] < p->note_end[h[c]] )
+            c++;
+        if( p->note_end[h[c]] >= p->note_end[moved] )
+            break;
+        h[i] = h[c];
+    }
+    h[i] = moved;
+    return top;
+}
+
+/*  renders samples [pos, pos+n) of every track, adding into out_f (phase
+ *  modes) or out_d (MML_OSC_TIME) as frames of channels samples. only the
+ *  sounding tracks (voices) and the resting ones that wake up inside the
+ *  span are visited, in track order so the sum doesn't depend on how the
+ *  song was cut into spans. with more than one channel n is at most
+ *  MML__SPAN_CHUNK, each track is mixed on its own and then panned in */
+void mml__render_span(mml_player_t* p,mml__mix_fn mix,float* out_f,double* out_d,
+                      unsigned int n,unsigned int channels,uint32_t pos,int resync,int stale)
+{
+    const mml_song_t* s = p->song;
+    const double rate = p->rate;
+    unsigned int i,k,x,y,m,v,a,a2,end,wave;
+    uint32_t * voices = p->voices;
+    int note_on,track_stale;
+    uint32_t r,inc,ph;
+    unsigned char pitch;
+    int pan;
+    const float * levels;
+    float gains[MML_MAX_CHANNELS] = { 0.0f };
+    float track[MML__SPAN_CHUNK];
+    double t,g,c,freq;
+
+    if( stale )
+    {
+        /* start over with every unfinished track as a voice, the first
+         * span sorts them out */
+        p->voice_count = 0;
+        p->rest_count = 0;
+        for( i=0; i<s->track_count; i++ )
+            if( p->track_pos[i] != s->track_lengths[i] )
+                voices[p->voice_count++] = i;
+    }
+    while( p->rest_count && p->note_end[p->resting[0]] < pos+n )
+    {
+        i = mml__rest_pop(p);
+        for( v=p->voice_count++; v>0 && voices[v-1] > i; v-- )
+            voices[v] = voices[v-1];
+        voices[v] = i;
+    }
+
+    for( v=a=0; v<p->voice_count; v++ )
+    {
+        i = voices[v];
+        k = s->track_offsets[i] + p->track_pos[i];
+        end = s->track_offsets[i] + s->track_lengths[i];
+        wave = s->waves[i];
+        note_on = resync;
+        track_stale = stale;
+        pan = -1;
+        for( x=0; x<n; x+=m )
+        {
+            r = pos+x;
+            /* the track's state only moves at its events */
+            if( track_stale || r >= p->note_end[i] )
+            {
+                while( mml__tick_sample(s,rate,MML__NOTE_END(s,k)+p->tick_shift[i]) <= r )
+                {
+                    note_on = 1;
+                    if( (k = mml__track_follow(p,i,k+1)) == end )
+                        break;
+                }
+                if( k == end )
+                    break;
+                /* a note's next event is where its gate ends, then where
+                 * the rest of its length does */
+                p->note_end[i] = mml__tick_sample(s,rate,s->starts[k]
+                                        +s->notes[k].gate+p->tick_shift[i]);
+                p->silent[i] = s->notes[k].pitch == MML_PITCH_REST
+                            || p->note_end[i] <= r;
+                if( p->silent[i] )
+                    p->note_end[i] = mml__tick_sample(s,rate,MML__NOTE_END(s,k)+p->tick_shift[i]);
+                track_stale = 0;
+            }
+            m = p->note_end[i] - r;
+            if( m > n-x )
+                m = n-x;
+
+            pitch = s->notes[k].pitch;
+            if( !p->silent[i] )
+            {
+                g = s->volume*mml_quant_values[s->notes[k].volume];
+                if( channels > 1 && s->notes[k].pan != pan )
+                {
+                    pan = s->notes[k].pan;
+                    mml__pan_gains(gains,channels,mml__note_pan(p,i,pan));
+                }
+                if( out_f )
+                {
+                    /* phase is re-derived from the sample position on each
+                     * note-on so, like MML_OSC_TIME, the waveform depends
+                     * only on where in the song it is */
+                    inc = p->pitch_inc[pitch];
+                    ph = note_on ? inc*r : p->phase[i]+inc;
+                    levels = mml__wave_mip(wave,p->oscillator,inc);
+                    if( channels == 1 )
+                        mix(out_f+x,m,ph,inc,levels,MML__MIP_SHIFT,(float)g);
+                    else
+                    {
+                        memset(track,0,m*sizeof(float));
+                        mix(track,m,ph,inc,levels,MML__MIP_SHIFT,(float)g);
+                        mml__pan_add(out_f+x*channels,track,m,channels,gains);
+                    }
+                    p->phase[i] = ph + inc*(m-1);
+                }
+                else
+                {
+                    freq = mml_note_frequencies[pitch];
+                    for( y=0; y<m; y++ )
+                    {
+                        t = (double)(r+y)/rate;
+                        c = NOTE_LOOKUP(t,wave,freq);
+                        if( channels == 1 )
+                            out_d[x+y] += g*c;
+                        else
+                            for( a2=0; a2<channels; a2++ )
+                                out_d[(x+y)*channels+a2] += gains[a2]*(g*c);
+                    }
+                }
+            }
+            note_on = 0;
+        }
+        p->track_pos[i] = k - s->track_offsets[i];
+
+        /* whatever the track is on at the end of the span decides where
+         * it waits for the next one */
+        if( k == end )
+            continue;
+        if( p->silent[i] )
+            mml__rest_push(p,i);
+        else
+            voices[a++] = i;
+    }
+    p->voice_count = a;
+}
+
+/*  the decoder behind mml_player_decode_stream, _block and _frames,
+ *  writes frames frames of channels samples to out (or out_d). song time is an integer sample position and
+ *  note boundaries are integer ticks turned into sample positions, so
+ *  nothing drifts however long the song loops and the state after any
+ *  number of samples depends only on where in the song they got (see
+ *  mml__player_seek_frame). the block is cut where the song wraps and
+ *  each piece is rendered with mml__render_span */
+void mml__decode(mml_player_t* p,double sample_rate,float* out,double* out_d,
+                 unsigned int frames,unsigned int channels)
+{
+    const mml__mix_fn mix = mml__select_mix();
+    unsigned int f,x,n;
+    int resync,stale;
+    double at;
+    uint32_t pos;
+    float mixed[MML__SPAN_CHUNK];
+    double summed[MML__SPAN_CHUNK];
+
+    if( sample_rate > 0.0 && sample_rate < HUGE_VAL && p->rate != sample_rate )
+        mml__set_rate(p,sample_rate);
+
+    if( !(sample_rate > 0.0 && sample_rate < HUGE_VAL) || p->song_end == 0 )
+    {
+        /* no time passes, or nothing to play */
+        for( f=0; f<frames*channels; f++ )
+        {
+            if( out )
+                out[f] = 0.0f;
+            else
+                out_d[f] = 0.0;
+        }
+        return;
+    }
+
+    if( p->resync & MML__RESYNC_SEEK )
+    {
+        /* the sample straight playback would be at. past the end it goes
+         * round from the loop point, in whole samples as playback does, so
+         * however many passes in the seek is it lands on the same one */
+        at = floor(p->seek_time*sample_rate + 0.5);
+        if( !(at > 0.0 && at < HUGE_VAL) )
+            at = 0.0;           /* before the start, or not a time at all */
+        if( at >= p->song_end )
+            at = p->loop_start + fmod(at - p->loop_start,(double)(p->song_end - p->loop_start));
+        pos = (uint32_t)at;
+        mml__player_locate(p,pos < p->song_end ? pos : p->loop_start);
+        p->frac = 0.0;
+        p->resync |= MML__RESYNC_PHASE | MML__RESYNC_EVENTS;
+    }
+    resync = p->resync & MML__RESYNC_PHASE;
+    stale = p->resync & MML__RESYNC_EVENTS;
+    p->resync = 0;
+
+    for( f=0; f<frames; f+=n )
+    {
+        if( p->pos >= p->song_end )
+        {
+            /* past the end of the song, go back to its loop point */
+            mml__player_locate(p,p->loop_start);
+            resync = 1;
+            stale = 1;
+        }
+        n = frames-f;
+        if( p->song_end - p->pos < n )
+            n = p->song_end - p->pos;
+
+        if( p->oscillator != MML_OSC_TIME && out )
+        {
+            if( channels > 1 && n > MML__SPAN_CHUNK )
+                n = MML__SPAN_CHUNK;
+            memset(out+f*channels,0,n*channels*sizeof(float));
+            mml__render_span(p,mix,out+f*channels,NULL,n,channels,p->pos,resync,stale);
+        }
+        else
+        {
+            if( n > MML__SPAN_CHUNK/channels )
+                n = MML__SPAN_CHUNK/channels;
+            if( p->oscillator != MML_OSC_TIME )
+            {
+                memset(mixed,0,n*channels*sizeof(float));
+                mml__render_span(p,mix,mixed,NULL,n,channels,p->pos,resync,stale);
+                for( x=0; x<n*channels; x++ )
+                    summed[x] = mixed[x];
+            }
+            else
+            {
+                memset(summed,0,n*channels*sizeof(double));
+                mml__render_span(p,mix,NULL,summed,n,channels,p->pos,resync,stale);
+            }
+            for( x=0; x<n*channels; x++ )
+            {
+                if( out )
+                    out[f*channels+x] = (float)summed[x];
+                else
+                    out_d[f*channels+x] = summed[x];
+            }
+        }
+        p->pos += n;
+        resync = 0;
+        stale = 0;
+    }
+}
+
+/*  one MML_OSC_TIME sample into p->held straight from the voices, for
+ *  mml_player_decode_stream. when nothing is pending and no track has an
+ *  event at the sample, mml__render_span would only add up the sounding
+ *  tracks, so this makes the same sum in the same order without setting
+ *  a span up. returns 0, having changed nothing, if mml__decode is needed */
+int mml__decode_one(mml_player_t* p,double rate)
+{
+    const mml_song_t* s = p->song;
+    const uint32_t pos = p->pos;
+    const double t = (double)pos/rate;
+    const mml_note_t* note;
+    unsigned int v,i;
+    double r = 0.0,g,c;
+
+    if( p->oscillator != MML_OSC_TIME || p->resync || p->rate != rate
+        || pos >= p->song_end
+        || (p->rest_count && p->note_end[p->resting[0]] <= pos) )
+        return 0;
+    for( v=0; v<p->voice_count; v++ )
+    {
+        i = p->voices[v];
+        if( p->note_end[i] <= pos )
+            return 0;
+        note = &s->notes[s->track_offsets[i] + p->track_pos[i]];
+        g = s->volume*mml_quant_values[note->volume];
+        c = NOTE_LOOKUP(t,s->waves[i],mml_note_frequencies[note->pitch]);
+        r += g*c;
+    }
+    p->held = r;
+    p->pos++;
+    return 1;
+}
+
+double mml_player_decode_stream(mml_player_t* p,double dt)
+{
+    double rate;
+    if( !(dt > 0.0) )
+        return p->held;
+    /* a dt so small its rate overflows doesn't advance either */
+    rate = 1.0/dt;
+    if( rate < HUGE_VAL && !mml__decode_one(p,rate) )
+        mml__decode(p,rate,NULL,&p->held,1,1);
+    return p->held;
+}
+
+void mml_player_decode_block(mml_player_t* p,float* out,unsigned int frames,double sample_rate)
+{
+    mml__decode(p,sample_rate,out,NULL,frames,1);
+}
+
+void mml_player_decode_frames(mml_player_t* p,float* out,unsigned int frames,unsigned int channels,double sample_rate)
+{
+    if( channels < 1 || channels > MML_MAX_CHANNELS )
+        return;
+    mml__decode(p,sample_rate,out,NULL,frames,channels);
+}
+
+/* full scale floats to int16, rounded to nearest and clipped */
+void mml__to_s16(int16_t* out,const float* in,unsigned int n)
+{
+    unsigned int x = 0;
+    float v;
+#if defined(MML__SIMD_X86) && defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    __m128i a,b;
+    for( ; x+8<=n; x+=8 )
+    {
+        /* max takes lo for a NaN, like the loop below */
+        a = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in+x),scale),lo),hi));
+        b = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in+x+4),scale),lo),hi));
+        _mm_storeu_si128((__m128i*)(out+x),_mm_packs_epi32(a,b));
+    }
+#endif
+    for( ; x<n; x++ )
+    {
+        v = in[x]*32767.0f;
+        if( !(v > -32768.0f) )
+            v = -32768.0f;
+        else if( v > 32767.0f )
+            v = 32767.0f;
+        out[x] = (int16_t)lrintf(v);
+    }
+}
+
+void mml_player_decode_frames_s16(mml_player_t* p,int16_t* out,unsigned int frames,unsigned int channels,double sample_rate)
+{
+    float buf[MML__SPAN_CHUNK*MML_MAX_CHANNELS];
+    unsigned int f,n;
+
+    if( channels < 1 || channels > MML_MAX_CHANNELS )
+        return;
+    for( f=0; f<frames; f+=n )
+    {
+        n = frames-f < MML__SPAN_CHUNK ? frames-f : MML__SPAN_CHUNK;
+        mml__decode(p,sample_rate,buf,NULL,n,channels);
+        mml__to_s16(out+f*channels,buf,n*channels);
+    }
+}
+
+void mml_player_set_pan(mml_player_t* p,unsigned int track,float pan)
+{
+    if( track < p->song->track_count )
+        p->pan[track] = pan < -2.0f ? -2.0f : pan > 2.0f ? 2.0f : pan;
+}
+
+
+void mml_reset_decode_state(mml_t* m)
+{
+    mml_player_reset(&m->player);
+}
+
+void mml_set_oscillator(mml_t* m,int mode)
+{
+    mml_player_set_oscillator(&m->player,mode);
+}
+
+void mml_seek(mml_t* m,double seconds)
+{
+    mml_player_seek(&m->player,seconds);
+}
+
+
+/*  minimal threads, fn(arg) runs on a new thread until joined */
+typedef void (*mml__thread_fn)(void*);
+
+typedef struct {
+    mml__thread_fn fn;
+    void* arg;
+#ifndef MML_NO_THREADS
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+#endif
+} mml__thread_t;
+
+#ifndef MML_NO_THREADS
+#ifdef _WIN32
+DWORD WINAPI mml__thread_main(LPVOID t)
+{
+    ((mml__thread_t*)t)->fn(((mml__thread_t*)t)->arg);
+    return 0;
+}
+#else
+void* mml__thread_main(void* t)
+{
+    ((mml__thread_t*)t)->fn(((mml__thread_t*)t)->arg);
+    return NULL;
+}
+#endif
+#endif
+
+/*  returns 0 if the thread couldn't be started (or threads are disabled),
+ *  the caller should run fn(arg) itself then */
+int mml__thread_start(mml__thread_t* t,mml__thread_fn fn,void* arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+#ifdef MML_NO_THREADS
+    return 0;
+#elif defined(_WIN32)
+    t->handle = CreateThread(NULL,0,mml__thread_main,t,0,NULL);
+    return t->handle != NULL;
+#else
+    return pthread_create(&t->handle,NULL,mml__thread_main,t) == 0;
+#endif
+}
+
+void mml__thread_join(mml__thread_t* t)
+{
+#ifdef MML_NO_THREADS
+    (void)t;
+#elif defined(_WIN32)
+    WaitForSingleObject(t->handle,INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->handle,NULL);
+#endif
+}
+
+typedef struct {
+    const mml_t* m;
+    double sample_rate;
+    float* out;
+    unsigned int first;
+    unsigned int count;
+    int failed;
+} mml__render_job_t;
+
+/*  renders one time range with a private player started exactly where a
+ *  straight-through render would be at that frame */
+void mml__render_range(void* arg)
+{
+    mml__render_job_t* job = (mml__render_job_t*)arg;
+    mml_player_t* p = mml_player_create(&job->m->song);
+    if( p == NULL )
+    {
+        job->failed = 1;
+        return;
+    }
+    mml_player_set_oscillator(p,job->m->player.oscillator);
+    mml__player_seek_frame(p,job->first,job->sample_rate);
+    mml_player_decode_block(p,job->out+job->first,job->count,job->sample_rate);
+    mml_player_free(p);
+}
+
+float* mml_render_all(const mml_t* m,double sample_rate,unsigned int threads,unsigned int* frames)
+{
+    unsigned int i,n,first;
+    int failed = 0;
+    float* out;
+    mml__render_job_t* jobs;
+    mml__thread_t* th;
+    int* started;
+
+    *frames = 0;
+    if( !(sample_rate > 0.0 && sample_rate < HUGE_VAL) )
+        return NULL;
+
+    /* one pass covers every sample before the song's end, the decoder
+     * wraps on the first one past it */
+    n = mml__tick_sample(&m->song,sample_rate,m->song.length);
+
+    if( (out = (float*)MML_MALLOC(sizeof(float)*(n ? n : 1))) == NULL )
+        return NULL;
+    if( threads < 1 )
+        threads = 1;
+    if( threads > n )
+        threads = n ? n : 1;
+
+    jobs = (mml__render_job_t*)MML_MALLOC((sizeof(mml__render_job_t)
+                                            + sizeof(mml__thread_t)
+                                            + sizeof(int))*threads);
+    if( jobs == NULL )
+    {
+        MML_FREE(out);
+        return NULL;
+    }
+    th = (mml__thread_t*)(jobs + threads);
+    started = (int*)(th + threads);
+
+    for( i=0, first=0; i<threads; i++ )
+    {
+        jobs[i].m = m;
+        jobs[i].sample_rate = sample_rate;
+        jobs[i].out = out;
+        jobs[i].first = first;
+        jobs[i].count = n/threads + (i < n%threads);
+        jobs[i].failed = 0;
+        first += jobs[i].count;
+    }
+
+    /* the calling thread takes the first range itself */
+    for( i=1; i<threads; i++ )
+        started[i] = mml__thread_start(&th[i],mml__render_range,&jobs[i]);
+    mml__render_range(&jobs[0]);
+    for( i=1; i<threads; i++ )
+    {
+        if( started[i] )
+            mml__thread_join(&th[i]);
+        else
+            mml__render_range(&jobs[i]);
+    }
+
+    for( i=0; i<threads; i++ )
+        failed |= jobs[i].failed;
+    MML_FREE(jobs);
+    if( failed )
+    {
+        MML_FREE(out);
+        return NULL;
+    }
+
+    *frames = n;
+    return out;
+}
+
+#define MML__CACHE_LINE         64
+
+/*  the indices run freely and wrap with uint32_t, a frame's slot is its
+ *  index & mask. each side's index sits on its own cache line so the two
+ *  threads don't keep taking the line from each other */
+struct mml_ring_t {
+    float * frames;
+    uint32_t mask;
+    uint32_t low_watermark;
+    char pad0[MML__CACHE_LINE];
+    uint32_t write;             /* stored by the producer only */
+    char pad1[MML__CACHE_LINE - sizeof(uint32_t)];
+    uint32_t read;              /* these by the consumer only */
+    uint32_t underruns;
+    uint32_t missed;
+};
+
+mml_ring_t* mml_ring_create(unsigned int frames,unsigned int low_watermark)
+{
+    mml_ring_t* r;
+    uint32_t n = 1;
+
+    if( frames > 0x80000000u )
+        return NULL;
+    while( n < frames )
+        n <<= 1;
+    r = (mml_ring_t*)MML_MALLOC(sizeof(mml_ring_t) + sizeof(float)*n);
+    if( r == NULL )
+        return NULL;
+    r->frames = (float*)(r+1);
+    r->mask = n-1;
+    r->low_watermark = low_watermark < n ? low_watermark : n;
+    r->write = 0;
+    r->read = 0;
+    r->underruns = 0;
+    r->missed = 0;
+    return r;
+}
+
+void mml_ring_free(mml_ring_t* r)
+{
+    MML_FREE(r);
+}
+
+unsigned int mml_ring_buffered(const mml_ring_t* r)
+{
+    uint32_t read = MML__LOAD_ACQUIRE(r->read);
+    return MML__LOAD_ACQUIRE(r->write) - read;
+}
+
+unsigned int mml_ring_wanted(const mml_ring_t* r)
+{
+    uint32_t buffered = mml_ring_buffered(r);
+    return buffered < r->low_watermark ? r->mask+1 - buffered : 0;
+}
+
+/*  the free space from the producer's side, the consumer can only make
+ *  more of it meanwhile */
+unsigned int mml__ring_space(const mml_ring_t* r)
+{
+    return r->mask+1 - (r->write - MML__LOAD_ACQUIRE(r->read));
+}
+
+unsigned int mml_ring_render(mml_ring_t* r,mml_player_t* p,double sample_rate,unsigned int frames)
+{
+    uint32_t at = r->write & r->mask;
+    unsigned int n = mml__ring_space(r),first;
+
+    if( frames < n )
+        n = frames;
+    /* decoding in two pieces where the ring wraps gives the same samples
+     * as one block */
+    first = r->mask+1 - at < n ? r->mask+1 - at : n;
+    if( first > 0 )
+        mml_player_decode_block(p,r->frames + at,first,sample_rate);
+    if( n > first )
+        mml_player_decode_block(p,r->frames,n - first,sample_rate);
+    MML__STORE_RELEASE(r->write,r->write + n);
+    return n;
+}
+
+unsigned int mml_ring_write(mml_ring_t* r,const float* in,unsigned int frames)
+{
+    uint32_t at = r->write & r->mask;
+    unsigned int n = mml__ring_space(r),first;
+
+    if( frames < n )
+        n = frames;
+    first = r->mask+1 - at < n ? r->mask+1 - at : n;
+    memcpy(r->frames + at,in,sizeof(float)*first);
+    memcpy(r->frames,in + first,sizeof(float)*(n - first));
+    MML__STORE_RELEASE(r->write,r->write + n);
+    return n;
+}
+
+unsigned int mml_ring_read(mml_ring_t* r,float* out,unsigned int frames)
+{
+    uint32_t at = r->read & r->mask;
+    unsigned int n = MML__LOAD_ACQUIRE(r->write) - r->read,first;
+
+    if( frames < n )
+        n = frames;
+    first = r->mask+1 - at < n ? r->mask+1 - at : n;
+    memcpy(out,r->frames + at,sizeof(float)*first);
+    memcpy(out + first,r->frames,sizeof(float)*(n - first));
+    MML__STORE_RELEASE(r->read,r->read + n);
+    if( n < frames )
+    {
+        memset(out + n,0,sizeof(float)*(frames - n));
+        MML__STORE_RELEASE(r->underruns,r->underruns + 1);
+        MML__STORE_RELEASE(r->missed,r->missed + (frames - n));
+    }
+    return n;
+}
+
+unsigned int mml_ring_underruns(const mml_ring_t* r,unsigned int* frames_missed)
+{
+    if( frames_missed )
+        *frames_missed = MML__LOAD_ACQUIRE(r->missed);
+    return MML__LOAD_ACQUIRE(r->underruns);
+}
+
+double mml_decode_stream(mml_t* m,double dt)
+{
+    return mml_player_decode_stream(&m->player,dt);
+}
+
+void mml_decode_block(mml_t* m,float* out,unsigned int frames,double sample_rate)
+{
+    mml_player_decode_block(&m->player,out,frames,sample_rate);
+}
+
+void mml_decode_frames(mml_t* m,float* out,unsigned int frames,unsigned int channels,double sample_rate)
+{
+    mml_player_decode_frames(&m->player,out,frames,channels,sample_rate);
+}
+
+void mml_decode_frames_s16(mml_t* m,int16_t* out,unsigned int frames,unsigned int channels,double sample_rate)
+{
+    mml_player_decode_frames_s16(&m->player,out,frames,channels,sample_rate);
+}
+
+void mml_set_pan(mml_t* m,unsigned int track,float pan)
+{
+    mml_player_set_pan(&m->player,track,pan);
+}
+
+/*  bytes needed after an mml_player_t for its per track arrays */
+#define MML__PLAYER_ARRAYS_SIZE(track_count) \
+        ( (3*sizeof(unsigned int) + (5+MML_MAX_LOOP_DEPTH)*sizeof(uint32_t) \
+           + sizeof(float))*(track_count) )
+
+/*  points p at song and lays its per track arrays out in mem, which must
+ *  be MML__PLAYER_ARRAYS_SIZE bytes */
+void mml__init_player(mml_player_t* p,const mml_song_t* song,void* mem)
+{
+    p->song = song;
+    p->track_pos = (unsigned int*)mem;
+    p->phase = (uint32_t*)(p->track_pos + song->track_count);
+    p->note_end = p->phase + song->track_count;
+    p->voices = p->note_end + song->track_count;
+    p->resting = p->voices + song->track_count;
+    p->tick_shift = p->resting + song->track_count;
+    p->loop_counts = p->tick_shift + song->track_count;
+    p->loop_depth = (unsigned int*)(p->loop_counts
+                                    + song->track_count*MML_MAX_LOOP_DEPTH);
+    p->silent = p->loop_depth + song->track_count;
+    p->pan = (float*)(p->silent + song->track_count);
+    memset(p->pan,0,sizeof(float)*song->track_count);
+    p->voice_count = 0;
+    p->rest_count = 0;
+    p->oscillator = MML_OSC_TIME;
+    p->rate = 0.0;
+    p->song_end = 0;
+    p->loop_start = 0;
+    p->seek_time = 0.0;
+    p->held = 0.0;
+    mml_player_reset(p);
+}
+
+mml_player_t* mml_player_create(const mml_song_t* song)
+{
+    mml_player_t* p = (mml_player_t*)MML_MALLOC(sizeof(mml_player_t)
+                            + MML__PLAYER_ARRAYS_SIZE(song->track_count));
+    if( p != NULL )
+        mml__init_player(p,song,p+1);
+    return p;
+}
+
+void mml_player_free(mml_player_t* p)
+{
+    MML_FREE(p);
+}
+
+/*  a wait and wake-up for the mixer's pool */
+typedef struct {
+#ifndef MML_NO_THREADS
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake;    /* workers, a new pass */
+    CONDITION_VARIABLE done;    /* the caller, the last worker finished */
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+#endif
+#endif
+    unsigned int pass;          /* counts passes handed out */
+    unsigned int busy;          /* workers still on the current one */
+    int quit;
+} mml__pool_sync_t;
+
+#ifdef MML_NO_THREADS
+/* no workers ever start, only the caller takes these */
+#define mml__sync_lock(s)       ((void)0)
+#define mml__sync_unlock(s)     ((void)0)
+#define mml__sync_wait(s,c)     ((void)0)
+#define mml__sync_wake(s,c)     ((void)0)
+#elif defined(_WIN32)
+#define mml__sync_lock(s)       EnterCriticalSection(&(s)->lock)
+#define mml__sync_unlock(s)     LeaveCriticalSection(&(s)->lock)
+#define mml__sync_wait(s,c)     SleepConditionVariableCS(&(s)->c,&(s)->lock,INFINITE)
+#define mml__sync_wake(s,c)     WakeAllConditionVariable(&(s)->c)
+#else
+#define mml__sync_lock(s)       pthread_mutex_lock(&(s)->lock)
+#define mml__sync_unlock(s)     pthread_mutex_unlock(&(s)->lock)
+#define mml__sync_wait(s,c)     pthread_cond_wait(&(s)->c,&(s)->lock)
+#define mml__sync_wake(s,c)     pthread_cond_broadcast(&(s)->c)
+#endif
+
+typedef struct {
+    mml_player_t * player;      /* NULL once removed */
+    float * block;              /* its frames for the current pass */
+    float left, right;          /* gain after balance */
+} mml__mixer_source_t;
+
+/*  one worker's share of a pass, tasks [next, end) packed as end << 32 |
+ *  next. the owner takes from the front and thieves from the back, each
+ *  with a compare and swap, so a task is only ever taken once */
+typedef struct {
+    uint64_t range;
+    char pad[MML__CACHE_LINE - sizeof(uint64_t)];
+} mml__mixer_queue_t;
+
+typedef struct {
+    mml_mixer_t * mx;
+    unsigned int index;
+    mml__thread_t thread;
+} mml__mixer_worker_t;
+
+/*  frames summed at a time, one chunk of stereo output stays in L1 while
+ *  every source's block streams through it */
+#define MML__MIX_CHUNK          1024
+
+struct mml_mixer_t {
+    mml__mixer_source_t * sources;
+    unsigned int * active;      /* sources playing this pass, in order */
+    unsigned int active_count;
+    unsigned int block;
+    unsigned int threads;
+    unsigned int started;       /* worker threads running, besides the caller */
+    mml__mixer_queue_t * queues;
+    mml__mixer_worker_t * workers;
+    mml__pool_sync_t sync;
+
+    /* the pass being worked on */
+    int summing;                /* rendering sources or summing chunks */
+    float * out;
+    unsigned int frames;
+    double sample_rate;
+};
+
+/* takes a task from q, from the back when stealing. 0 if it's empty */
+int mml__mixer_take(mml__mixer_queue_t* q,unsigned int* task,int steal)
+{
+    uint64_t old = MML__LOAD64(q->range);
+    uint32_t next,end;
+    for( ;; )
+    {
+        next = (uint32_t)old;
+        end = (uint32_t)(old >> 32);
+        if( next >= end )
+            return 0;
+        if( steal ? MML__CAS64(q->range,old,(uint64_t)(end-1) << 32 | next)
+                  : MML__CAS64(q->range,old,(uint64_t)end << 32 | (next+1)) )
+            break;
+        old = MML__LOAD64(q->range);
+    }
+    *task = steal ? end-1 : next;
+    return 1;
+}
+
+void mml__mixer_task(mml_mixer_t* mx,unsigned int task)
+{
+    mml__mixer_source_t * src;
+    unsigned int first,n,i,x;
+    float * out;
+
+    if( !mx->summing )
+    {
+        src = &mx->sources[mx->active[task]];
+        mml_player_decode_frames(src->player,src->block,mx->frames,2,mx->sample_rate);
+        return;
+    }
+    first = task*MML__MIX_CHUNK;
+    n = mx->frames - first < MML__MIX_CHUNK ? mx->frames - first : MML__MIX_CHUNK;
+    out = mx->out + 2*first;
+    memset(out,0,sizeof(float)*2*n);
+    for( i=0; i<mx->active_count; i++ )
+    {
+        src = &mx->sources[mx->active[i]];
+        for( x=0; x<n; x++ )
+        {
+            out[2*x] += src->left*src->block[2*(first+x)];
+            out[2*x+1] += src->right*src->block[2*(first+x)+1];
+        }
+    }
+}
+
+/* works through its own queue, then steals until every queue is empty */
+void mml__mixer_work(mml_mixer_t* mx,unsigned int self)
+{
+    unsigned int task = 0,v;
+    for( ;; )
+    {
+        if( mml__mixer_take(&mx->queues[self],&task,0) )
+        {
+            mml__mixer_task(mx,task);
+            continue;
+        }
+        for( v=1; v<mx->threads; v++ )
+            if( mml__mixer_take(&mx->queues[(self+v) % mx->threads],&task,1) )
+                break;
+        if( v == mx->threads )
+            return;
+        mml__mixer_task(mx,task);
+    }
+}
+
+void mml__mixer_worker_main(void* arg)
+{
+    mml__mixer_worker_t* w = (mml__mixer_worker_t*)arg;
+    mml_mixer_t* mx = w->mx;
+    unsigned int seen = 0;
+
+    for( ;; )
+    {
+        mml__sync_lock(&mx->sync);
+        while( mx->sync.pass == seen && !mx->sync.quit )
+            mml__sync_wait(&mx->sync,wake);
+        seen = mx->sync.pass;
+        if( mx->sync.quit )
+        {
+            mml__sync_unlock(&mx->sync);
+            return;
+        }
+        mml__sync_unlock(&mx->sync);
+
+        mml__mixer_work(mx,w->index);
+
+        mml__sync_lock(&mx->sync);
+        if( --mx->sync.busy == 0 )
+            mml__sync_wake(&mx->sync,done);
+        mml__sync_unlock(&mx->sync);
+    }
+}
+
+/*  deals tasks out to the queues in even runs and works them with the
+ *  pool. a queue without a thread (one that didn't start) is stolen from */
+void mml__mixer_run(mml_mixer_t* mx,unsigned int tasks)
+{
+    unsigned int w;
+    uint64_t first,end;
+
+    for( w=0; w<mx->threads; w++ )
+    {
+        first = (uint64_t)tasks*w/mx->threads;
+        end = (uint64_t)tasks*(w+1)/mx->threads;
+        mx->queues[w].range = end << 32 | first;
+    }
+    if( mx->started == 0 || tasks < 2 )
+    {
+        mml__mixer_work(mx,0);
+        return;
+    }
+    mml__sync_lock(&mx->sync);
+    mx->sync.busy = mx->started;
+    mx->sync.pass++;
+    mml__sync_wake(&mx->sync,wake);
+    mml__sync_unlock(&mx->sync);
+
+    mml__mixer_work(mx,0);
+
+    mml__sync_lock(&mx->sync);
+    while( mx->sync.busy > 0 )
+        mml__sync_wait(&mx->sync,done);
+    mml__sync_unlock(&mx->sync);
+}
+
+mml_mixer_t* mml_mixer_create(unsigned int threads,unsigned int block)
+{
+    mml_mixer_t* mx;
+    unsigned int i;
+
+#ifdef MML_NO_THREADS
+    threads = 1;
+#endif
+    if( threads < 1 )
+        threads = 1;
+    if( block < 1 )
+        block = 1;
+    mx = (mml_mixer_t*)MML_MALLOC(sizeof(mml_mixer_t) + MML__CACHE_LINE
+                                  + (sizeof(mml__mixer_queue_t)
+                                     + sizeof(mml__mixer_worker_t))*threads);
+    if( mx == NULL )
+        return NULL;
+    /* each queue on its own cache line */
+    mx->queues = (mml__mixer_queue_t*)(((uintptr_t)(mx+1) + MML__CACHE_LINE-1)
+                                       & ~(uintptr_t)(MML__CACHE_LINE-1));
+    mx->workers = (mml__mixer_worker_t*)(mx->queues + threads);
+    mx->sources = NULL;
+    mx->active = NULL;
+    mx->active_count = 0;
+    mx->block = block;
+    mx->threads = threads;
+    mx->started = 0;
+    mx->summing = 0;
+    mx->sync.pass = 0;
+    mx->sync.busy = 0;
+    mx->sync.quit = 0;
+#ifndef MML_NO_THREADS
+#ifdef _WIN32
+    InitializeCriticalSection(&mx->sync.lock);
+    InitializeConditionVariable(&mx->sync.wake);
+    InitializeConditionVariable(&mx->sync.done);
+#else
+    pthread_mutex_init(&mx->sync.lock,NULL);
+    pthread_cond_init(&mx->sync.wake,NULL);
+    pthread_cond_init(&mx->sync.done,NULL);
+#endif
+#endif
+    /* the caller is worker 0 */
+    for( i=1; i<threads; i++ )
+    {
+        mx->workers[mx->started+1].mx = mx;
+        mx->workers[mx->started+1].index = i;
+        if( mml__thread_start(&mx->workers[mx->started+1].thread,
+                              mml__mixer_worker_main,&mx->workers[mx->started+1]) )
+            mx->started++;
+    }
+    return mx;
+}
+
+void mml_mixer_free(mml_mixer_t* mx)
+{
+    unsigned int i;
+
+    mml__sync_lock(&mx->sync);
+    mx->sync.quit = 1;
+    mml__sync_wake(&mx->sync,wake);
+    mml__sync_unlock(&mx->sync);
+    for( i=1; i<=mx->started; i++ )
+        mml__thread_join(&mx->workers[i].thread);
+#ifndef MML_NO_THREADS
+#ifdef _WIN32
+    DeleteCriticalSection(&mx->sync.lock);
+#else
+    pthread_mutex_destroy(&mx->sync.lock);
+    pthread_cond_destroy(&mx->sync.wake);
+    pthread_cond_destroy(&mx->sync.done);
+#endif
+#endif
+    for( i=0; i<sb_count(mx->sources); i++ )
+        mml_player_free(mx->sources[i].player);
+    sb_free(mx->sources);
+    sb_free(mx->active);
+    MML_FREE(mx);
+}
+
+int mml_mixer_add(mml_mixer_t* mx,const mml_song_t* song,float gain,float pan)
+{
+    mml__mixer_source_t src;
+    unsigned int i;
+
+    /* the player and its block in one allocation */
+    src.player = (mml_player_t*)MML_MALLOC(sizeof(mml_player_t)
+                                           + MML__PLAYER_ARRAYS_SIZE(song->track_count)
+                                           + sizeof(float)*2*mx->block);
+    if( src.player == NULL )
+        return -1;
+    mml__init_player(src.player,song,src.player+1);
+    src.block = (float*)((char*)(src.player+1) + MML__PLAYER_ARRAYS_SIZE(song->track_count));
+
+    /* a removed source's id is used again */
+    for( i=0; i<sb_count(mx->sources); i++ )
+        if( mx->sources[i].player == NULL )
+            break;
+    if( i == sb_count(mx->sources) )
+    {
+        sb_push(mx->sources,src);
+        /* room for all of them to play, so mixing never allocates */
+        sb_push(mx->active,0);
+    }
+    mx->sources[i] = src;
+    mml_mixer_set(mx,(int)i,gain,pan);
+    return (int)i;
+}
+
+void mml_mixer_remove(mml_mixer_t* mx,int id)
+{
+    mml_player_free(mx->sources[id].player);
+    mx->sources[id].player = NULL;
+}
+
+void mml_mixer_set(mml_mixer_t* mx,int id,float gain,float pan)
+{
+    double a;
+    if( pan < -1.0f ) pan = -1.0f;
+    if( pan > 1.0f ) pan = 1.0f;
+    /* scaled so the middle is unity on both sides */
+    a = (pan+1.0)*MML_PI/4.0;
+    mx->sources[id].left = (float)(gain*cos(a)*MML_SQRT2);
+    mx->sources[id].right = (float)(gain*sin(a)*MML_SQRT2);
+}
+
+mml_player_t* mml_mixer_player(mml_mixer_t* mx,int id)
+{
+    return mx->sources[id].player;
+}
+
+void mml_mixer_mix(mml_mixer_t* mx,float* out,unsigned int frames,double sample_rate)
+{
+    unsigned int i,n,count;
+
+    count = 0;
+    for( i=0; i<sb_count(mx->sources); i++ )
+        if( mx->sources[i].player != NULL )
+            mx->active[count++] = i;
+    mx->active_count = count;
+
+    for( ; frames > 0; frames -= n, out += 2*n )
+    {
+        n = frames < mx->block ? frames : mx->block;
+        mx->out = out;
+        mx->frames = n;
+        mx->sample_rate = sample_rate;
+        mx->summing = 0;
+        mml__mixer_run(mx,count);
+        mx->summing = 1;
+        mml__mixer_run(mx,(n + MML__MIX_CHUNK-1)/MML__MIX_CHUNK);
+    }
+}
+
+
+/*  a song, its player and everything they point to live in one block:
+ *      mml_t | tempo_seconds | notes | starts | player arrays | waves
+ *            | track_lengths | track_offsets | pattern_lengths
+ *            | pattern_offsets | tempo_ticks | tempo_bpm
+ *  so mml_free is a single free. notes holds every pattern's records and
+ *  then every track's back to back (live editing leaves gaps, see
+ *  mml__edit_layout). the notes, the track and pattern
+ *  lengths and the tempo ticks and bpms must be filled in before
+ *  mml__link_tracks works out where each track, pattern, note, loop and
+ *  tempo starts */
+mml_t* mml__alloc_song(unsigned int track_count,unsigned int pattern_count,
+                       unsigned int note_count,unsigned int tempo_count)
+{
+    mml_t* m;
+    size_t sz = sizeof(mml_t)
+              + sizeof(double)*tempo_count
+              + (sizeof(mml_note_t) + sizeof(uint32_t))*note_count
+              + MML__PLAYER_ARRAYS_SIZE(track_count)
+              + sizeof(unsigned int)*track_count*3
+              + sizeof(unsigned int)*pattern_count*2
+              + sizeof(uint32_t)*tempo_count*2;
+
+    m = (mml_t*)MML_MALLOC(sz);
+    if( m == NULL )
+        return NULL;
+
+    m->song.tempo_seconds = (double*)(m+1);
+    m->song.notes = (mml_note_t*)(m->song.tempo_seconds + tempo_count);
+    m->song.starts = (uint32_t*)(m->song.notes + note_count);
+    m->song.waves = (unsigned int*)((char*)(m->song.starts + note_count)
+                                    + MML__PLAYER_ARRAYS_SIZE(track_count));
+    m->song.track_lengths = m->song.waves + track_count;
+    m->song.track_offsets = m->song.track_lengths + track_count;
+    m->song.pattern_lengths = m->song.track_offsets + track_count;
+    m->song.pattern_offsets = m->song.pattern_lengths + pattern_count;
+    m->song.tempo_ticks = m->song.pattern_offsets + pattern_count;
+    m->song.tempo_bpm = m->song.tempo_ticks + tempo_count;
+
+    m->song.track_count = track_count;
+    m->song.pattern_count = pattern_count;
+    m->song.tempo_count = tempo_count;
+    m->song.beats_per_minute = MML_DEFAULT_TEMPO;
+    m->song.length = 0;
+    m->song.loop_tick = 0;
+    m->song.volume = 0.0;
+
+    return m;
+}
+
+/* deepest nesting inside pattern n, kept in its return record */
+#define MML__PATTERN_DEPTH(s,n) \
+        MML__ARG( (s)->notes[(s)->pattern_offsets[n] + (s)->pattern_lengths[n] - 1] )
+
+/*  links count records of one track (pattern 0) or pattern (pattern 1),
+ *  which may only call s's first patterns patterns, the first starting at
+ *  tick t. prefix sums of the note lengths are the seek index, a loop's
+ *  end record is where its repeats are counted in and a call counts its
+ *  whole pattern. the records needn't be in s, live editing links a
+ *  track's new ones on their own before they go in.
+ *  returns the deepest nesting reached, or -1 if loops don't pair up,
+ *  nest too deep or add up to more ticks than fit in a uint32_t */
+int mml__link_span(const mml_song_t* s,mml_note_t* notes,uint32_t* starts,
+                   unsigned int count,uint64_t t,unsigned int patterns,int pattern)
+{
+    unsigned int k,b,n,depth = 0,deepest = 0;
+    unsigned int open[MML_MAX_LOOP_DEPTH];
+    uint64_t body;
+
+    for( k=0; k<count; k++ )
+    {
+        starts[k] = (uint32_t)t;
+        notes[k].depth = depth;
+        switch( notes[k].pitch ) {
+            case MML_PITCH_LOOP_BEGIN:
+                if( depth == MML_MAX_LOOP_DEPTH )
+                    return -1;
+                mml__set_arg(&notes[k],0);
+                open[depth++] = k;
+                break;
+            case MML_PITCH_LOOP_END:
+                if( depth == 0 )
+                    return -1;
+                b = open[--depth];
+                notes[k].depth = depth;
+                mml__set_arg(&notes[k],k - b);
+                /* a pass has to take time, or the loop would spin */
+                body = t - starts[b];
+                if( body == 0 || notes[k].volume == 0 )
+                    notes[k].volume = 1;
+                t += body*(notes[k].volume-1);
+                starts[k] = (uint32_t)t;
+                break;
+            case MML_PITCH_CALL:
+                n = MML__ARG(notes[k]);
+                if( n >= patterns
+                    || depth+1+MML__PATTERN_DEPTH(s,n) > MML_MAX_LOOP_DEPTH )
+                    return -1;
+                if( depth+1+MML__PATTERN_DEPTH(s,n) > deepest )
+                    deepest = depth+1+MML__PATTERN_DEPTH(s,n);
+                t += MML__PATTERN_TICKS(s,n);
+                break;
+            case MML_PITCH_RETURN:
+                /* a pattern's last record and nowhere else */
+                if( !pattern || k != count-1 || depth != 0 )
+                    return -1;
+                mml__set_arg(&notes[k],deepest);
+                break;
+            default:
+                t += notes[k].length;
+                break;
+        }
+        if( depth > deepest )
+            deepest = depth;
+        if( t > 0xffffffffu )
+            return -1;
+    }
+    if( depth != 0 || (pattern && (count == 0 || notes[count-1].pitch != MML_PITCH_RETURN)) )
+        return -1;
+    return deepest;
+}
+
+/*  links the count records from k of one of s's tracks or patterns, see
+ *  mml__link_span */
+int mml__link_records(mml_song_t* s,unsigned int k,unsigned int count,
+                      unsigned int patterns,int pattern)
+{
+    return mml__link_span(s,s->notes+k,s->starts+k,count,0,patterns,pattern);
+}
+
+/*  returns 0 if a track or pattern's records are bad, see
+ *  mml__link_records */
+int mml__link_tracks(mml_t* m)
+{
+    mml_song_t* s = &m->song;
+    unsigned int i,k;
+    for( i=0, k=0; i<s->pattern_count; i++ )
+    {
+        s->pattern_offsets[i] = k;
+        if( mml__link_records(s,k,s->pattern_lengths[i],i,1) < 0 )
+            return 0;
+        k += s->pattern_lengths[i];
+    }
+    for( i=0; i<s->track_count; i++ )
+    {
+        s->track_offsets[i] = k;
+        if( mml__link_records(s,k,s->track_lengths[i],s->pattern_count,0) < 0 )
+            return 0;
+        k += s->track_lengths[i];
+    }
+    /* song time at each tempo change */
+    for( i=0; i<s->tempo_count; i++ )
+        s->tempo_seconds[i] = i == 0 ? 0.0
+            : s->tempo_seconds[i-1]
+              + (double)(s->tempo_ticks[i] - s->tempo_ticks[i-1])
+                * MML__TICK_SECONDS(s->tempo_bpm[i-1]);
+    s->beats_per_minute = s->tempo_bpm[0];
+    mml__init_player(&m->player,s,s->starts + k);
+    return 1;
+}
+
+void mml_free(mml_t* m)
+{
+    MML_FREE(m);
+}
+
+
+/*  compiled song layout, all fields in native byte order:
+ *      header | waves[track_count] | track_lengths[track_count]
+ *             | pattern_lengths[pattern_count] | tempo_ticks[tempo_count] | tempo_bpm[tempo_count]
+ *             | notes[note_count]
+ *  the notes are stored exactly as the song keeps them, loops included,
+ *  only their starts and the decode state are rebuilt on load */
+#define MML_COMPILED_MAGIC      "MMLC"
+#define MML_COMPILED_VERSION    8
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t track_count;
+    uint32_t note_count;
+    uint32_t length;
+    uint32_t tempo_count;
+    double volume;
+    uint32_t beats_per_minute;
+    uint32_t ticks_per_whole;
+    uint32_t loop_tick;
+    uint32_t pattern_count;
+} mml__compiled_header_t;
+
+#define MML__COMPILED_NOTE_SIZE sizeof(mml_note_t)
+
+unsigned int mml_save_compiled_mem(const mml_t* m,void* buf,unsigned int sz)
+{
+    unsigned int i,note_count = 0;
+    unsigned int need;
+    mml__compiled_header_t h;
+    char* out = (char*)buf;
+
+    for( i=0; i<m->song.track_count; i++ )
+        note_count += m->song.track_lengths[i];
+    for( i=0; i<m->song.pattern_count; i++ )
+        note_count += m->song.pattern_lengths[i];
+
+    need = sizeof(h)
+         + sizeof(uint32_t)*m->song.track_count*2
+         + sizeof(uint32_t)*m->song.pattern_count
+         + sizeof(uint32_t)*m->song.tempo_count*2
+         + MML__COMPILED_NOTE_SIZE*note_count;
+    if( buf == NULL || sz < need )
+        return need;
+
+    memcpy(h.magic,MML_COMPILED_MAGIC,4);
+    h.version = MML_COMPILED_VERSION;
+    h.track_count = m->song.track_count;
+    h.note_count = note_count;
+    h.length = m->song.length;
+    h.loop_tick = m->song.loop_tick;
+    h.pattern_count = m->song.pattern_count;
+    h.volume = m->song.volume;
+    h.beats_per_minute = m->song.beats_per_minute;
+    h.ticks_per_whole = MML_TICKS_PER_WHOLE;
+    h.tempo_count = m->song.tempo_count;
+    memcpy(out,&h,sizeof(h));
+    out += sizeof(h);
+
+    for( i=0; i<m->song.track_count; i++, out += sizeof(uint32_t) )
+        memcpy(out,&m->song.waves[i],sizeof(uint32_t));
+    for( i=0; i<m->song.track_count; i++, out += sizeof(uint32_t) )
+        memcpy(out,&m->song.track_lengths[i],sizeof(uint32_t));
+    for( i=0; i<m->song.pattern_count; i++, out += sizeof(uint32_t) )
+        memcpy(out,&m->song.pattern_lengths[i],sizeof(uint32_t));
+    for( i=0; i<m->song.tempo_count; i++, out += sizeof(uint32_t) )
+        memcpy(out,&m->song.tempo_ticks[i],sizeof(uint32_t));
+    for( i=0; i<m->song.tempo_count; i++, out += sizeof(uint32_t) )
+        memcpy(out,&m->song.tempo_bpm[i],sizeof(uint32_t));
+
+    /* the patterns and then each track, a live edited song leaves room
+     * after its tracks */
+    for( i=0; i<m->song.track_count; i++ )
+        note_count -= m->song.track_lengths[i];
+    memcpy(out,m->song.notes,sizeof(mml_note_t)*note_count);
+    out += sizeof(mml_note_t)*note_count;
+    for( i=0; i<m->song.track_count; i++ )
+    {
+        memcpy(out,m->song.notes + m->song.track_offsets[i],
+               sizeof(mml_note_t)*m->song.track_lengths[i]);
+        out += sizeof(mml_note_t)*m->song.track_lengths[i];
+    }
+
+    return need;
+}
+
+int mml_save_compiled(const mml_t* m,const char* filename)
+{
+    unsigned int sz = mml_save_compiled_mem(m,NULL,0);
+    void* buf = MML_MALLOC(sz);
+    FILE* f;
+    int ok = 0;
+
+    if( buf == NULL )
+        return 0;
+    mml_save_compiled_mem(m,buf,sz);
+    if( (f = fopen(filename,"wb")) != NULL )
+    {
+        ok = fwrite(buf,sz,1,f) == 1;
+        ok = (fclose(f) == 0) && ok;
+    }
+    MML_FREE(buf);
+
+    return ok;
+}
+
+mml_t* mml_open_compiled_mem(const void* buf,unsigned int sz)
+{
+    unsigned int i;
+    uint64_t total = 0;
+    int bad = 0;
+    mml__compiled_header_t h;
+    const char* in = (const char*)buf;
+    mml_t* m;
+
+    /* reject anything that isn't a complete compiled song of this version */
+    if( sz < sizeof(h) )
+        return NULL;
+    memcpy(&h,in,sizeof(h));
+    in += sizeof(h);
+    if( memcmp(h.magic,MML_COMPILED_MAGIC,4) != 0
+        || h.version != MML_COMPILED_VERSION
+        || h.ticks_per_whole != MML_TICKS_PER_WHOLE
+        || h.tempo_count == 0
+        || sizeof(h) + (uint64_t)sizeof(uint32_t)*2*h.track_count
+                     + (uint64_t)sizeof(uint32_t)*h.pattern_count
+                     + (uint64_t)sizeof(uint32_t)*2*h.tempo_count
+                     + (uint64_t)MML__COMPILED_NOTE_SIZE*h.note_count > sz )
+        return NULL;
+
+    if( (m = mml__alloc_song(h.track_count,h.pattern_count,h.note_count,
+                             h.tempo_count)) == NULL )
+        return NULL;
+    m->song.length = h.length;
+    m->song.loop_tick = h.loop_tick < h.length ? h.loop_tick : 0;
+    m->song.volume = h.volume;
+    m->song.beats_per_minute = h.beats_per_minute;
+
+    for( i=0; i<h.track_count; i++, in += sizeof(uint32_t) )
+        memcpy(&m->song.waves[i],in,sizeof(uint32_t));
+    for( i=0; i<h.track_count; i++, in += sizeof(uint32_t) )
+    {
+        memcpy(&m->song.track_lengths[i],in,sizeof(uint32_t));
+        m->song.waves[i] = mml__clamp(m->song.waves[i],0,NUM_VOICES-1);
+        total += m->song.track_lengths[i];
+    }
+    for( i=0; i<h.pattern_count; i++, in += sizeof(uint32_t) )
+    {
+        memcpy(&m->song.pattern_lengths[i],in,sizeof(uint32_t));
+        total += m->song.pattern_lengths[i];
+    }
+    for( i=0; i<h.tempo_count; i++, in += sizeof(uint32_t) )
+        memcpy(&m->song.tempo_ticks[i],in,sizeof(uint32_t));
+    for( i=0; i<h.tempo_count; i++, in += sizeof(uint32_t) )
+    {
+        memcpy(&m->song.tempo_bpm[i],in,sizeof(uint32_t));
+        if( m->song.tempo_bpm[i] < 1 )
+            m->song.tempo_bpm[i] = 1;
+        /* the map has to start at 0 and go forwards */
+        if( i > 0 && m->song.tempo_ticks[i] <= m->song.tempo_ticks[i-1] )
+            bad = 1;
+    }
+    if( bad || total != h.note_count || m->song.tempo_ticks[0] != 0 )
+    {
+        MML_FREE(m);
+        return NULL;
+    }
+
+    memcpy(m->song.notes,in,sizeof(mml_note_t)*h.note_count);
+
+    /* don't trust table indexes or gates from outside, control records
+     * are checked when the tracks are linked */
+    for( i=0; i<h.note_count; i++ )
+    {
+        if( m->song.notes[i].pan > MML_PAN_MAX )
+            m->song.notes[i].pan = MML_PAN_MAX;
+        if( MML__IS_CONTROL(m->song.notes[i].pitch) )
+            continue;
+        if( m->song.notes[i].pitch >= MML_PITCH_COUNT )
+            m->song.notes[i].pitch = MML_PITCH_REST;
+        if( m->song.notes[i].volume > 8 )
+            m->song.notes[i].volume = 8;
+        if( m->song.notes[i].pitch == MML_PITCH_REST )
+            m->song.notes[i].gate = 0;
+        else if( m->song.notes[i].gate > m->song.notes[i].length )
+            m->song.notes[i].gate = m->song.notes[i].length;
+    }
+
+    if( !mml__link_tracks(m) )
+    {
+        MML_FREE(m);
+        return NULL;
+    }
+    return m;
+}
+
+mml_t* mml_open_compiled(const char* filename)
+{
+    unsigned int sz = 0;
+    const char* buf;
+    mml_t* song;
+    
+#ifndef MML_NO_MMAP
+    if( (buf = mml__map_file(filename,&sz)) != NULL )
+    {
+        song = mml_open_compiled_mem(buf,sz);
+        mml__unmap_file(buf,sz);
+        return song;
+    }
+#endif
+    if( (buf = mml__read_file(filename,&sz)) == NULL )
+        return NULL;
+    song = mml_open_compiled_mem(buf,sz);
+    MML_FREE((void*)buf);
+    
+    return song;
+}
+
+
+
+mml_t* mml_open_file(const char* filename)
+{
+    unsigned int sz = 0;
+    const char* buf;
+    mml_t* song;
+    
+#ifndef MML_NO_MMAP
+    /* parse straight out of the page cache, no copy or read calls */
+    if( (buf = mml__map_file(filename,&sz)) != NULL )
+    {
+        song = mml_open_mem(buf,sz);
+        mml__unmap_file(buf,sz);
+        return song;
+    }
+#endif
+    if( (buf = mml__read_file(filename,&sz)) == NULL )
+        return NULL;
+    song = mml_open_mem(buf,sz);
+    MML_FREE((void*)buf);
+    
+    return song;
+}
+
+/* a new slot for a track or pattern, starting from the default state */
+unsigned int mml__add_slot(mml_parser_t* p)
+{
+    mml_read_state_t rs;
+    mml__loop_state_t ls;
+    rs.note_length = .25;
+    rs.hit_length = .75;
+    rs.octave = 4;
+    rs.volume = 8;
+    rs.pan = MML_PAN_CENTER;
+    ls.tempos = 0;
+    ls.depth = 0;
+    ls.ignored = 0;
+    ls.deepest = 0;
+    sb_push(p->rs,rs);
+    sb_push(p->loops,ls);
+    sb_push(p->ms_length,0);
+    sb_push(p->lengths,0);
+    return sb_count(p->rs)-1;
+}
+
+/* starts a segment for the track just switched to */
+void mml__begin_segment(mml_parser_t* p)
+{
+    mml__segment_t seg;
+    if( !p->log_segments )
+        return;
+    seg.begin = p->index;
+    seg.end = p->index;
+    seg.ended = 0;
+    seg.global = 0;
+    seg.track = p->current_track;
+    seg.patterns = sb_count(p->patterns);
+    seg.first = p->lengths[p->cur];
+    seg.records = 0;
+    seg.ticks_in = p->ms_length[p->cur];
+    seg.ticks = 0;
+    seg.rs_in = p->rs[p->cur];
+    seg.loops_in = p->loops[p->cur];
+    seg.nth = 0;
+    seg.next = 0;
+    sb_push(p->segments,seg);
+}
+
+/* ends the current segment at end, by a ';' or the end of the text */
+void mml__end_segment(mml_parser_t* p,unsigned int end,int ended)
+{
+    mml__segment_t * seg;
+    if( !p->log_segments || sb_count(p->segments) == 0
+        || sb_last(p->segments).ended )
+        return;
+    seg = &sb_last(p->segments);
+    seg->end = end;
+    seg->ended = ended;
+    seg->records = p->lengths[p->cur] - seg->first;
+    seg->ticks = p->sequence_counter;
+    seg->rs_out = p->rs[p->cur];
+    seg->loops_out = p->loops[p->cur];
+    if( ended && p->one_segment )
+        p->stopped = 1;
+}
+
+/* the current segment changed the song outside its own track */
+#define MML__GLOBAL(p)  do { if( (p)->log_segments && sb_count((p)->segments) ) \
+                                sb_last((p)->segments).global = 1; } while( 0 )
+
+/*  reads command c, whose arguments follow at p->index. every argument is
+ *  read before anything changes, so a command cut off by the end of a
+ *  chunk (p->starved) leaves the parser as it was and is read again once
+ *  the rest has arrived */
+void mml__parse_command(mml_parser_t* p,int c)
+{
+   mml__loop_state_t * ls;
+   mml__tempo_t tempo;
+   mml__pattern_def_t def;
+   uint32_t tick,body,length,rest_len;
+   int n,i,m;
+   double nl;
+
+   /* nothing to write notes to before the first 'w' */
+   if( p->cur < 0 && c != NULLCHAR && strchr("abcdefgrpolvqP<>[]",c) )
+      return;
+   switch( c ) {
+      case 'w': /* define wave */
+         if( p->wave_define && p->defining < 0 )
+         {
+            n = mml__get_num_modifier_s(p);
+            if( p->starved )
+               break;
+            p->data.track_count += 1;
+            p->current_track = p->data.track_count - 1;
+
+            p->data.volume += 1.0;
+
+            sb_push(p->data.waves,mml__clamp(n,0,NUM_VOICES-1));
+
+            p->cur = mml__add_slot(p);
+            sb_push(p->track_slots,p->cur);
+         }
+         break;
+      case '/':   /* comment */
+         if( MML__GETC(p) == '/' )        /* check for follow '/' */
+            p->in_comment = 1;
+         break;
+      case ';':   /* end current track and start new track */
+      {
+         if( p->defining >= 0 || p->data.track_count == 0 )
+            break;
+         if( p->wave_define )
+         {  /* we finish defining waves and reset counters */
+            p->wave_define = 0;
+            p->current_track = 0;
+            p->sequence_counter = 0;
+         }
+         else
+         {
+            mml__end_segment(p,p->index,1);
+            p->ms_length[p->cur] += p->sequence_counter;
+            p->sequence_counter = 0;
+
+            p->current_track += 1;
+            p->current_track %= p->data.track_count;
+         }
+         p->cur = p->track_slots[p->current_track];
+         mml__begin_segment(p);
+      }
+         break;
+      case 't':   /* tempo, for every track from this point of the song */
+         n = mml__get_num_modifier_s(p);
+         if( p->starved )
+            break;
+         if( n > 0 && p->defining < 0 && sb_count(p->tempos) < MML__MAX_TEMPOS )
+         {
+            MML__GLOBAL(p);
+            tempo.tick = p->wave_define ? 0
+                       : p->ms_length[p->cur] + p->sequence_counter;
+            tempo.bpm = n;
+            tempo.slot = p->cur < 0 ? 0 : (unsigned int)p->cur;
+            tempo.order = sb_count(p->tempos);
+            sb_push(p->tempos,tempo);
+            /* and again in every pass of the loops it's inside */
+            if( !p->wave_define )
+               p->loops[p->cur].tempos |= (1u << p->loops[p->cur].depth) - 1;
+         }
+         break;
+      case 'L':   /* song loop point */
+         if( p->defining < 0 )
+         {
+            MML__GLOBAL(p);
+            p->data.loop_tick = p->wave_define ? 0
+                              : p->ms_length[p->cur] + p->sequence_counter;
+         }
+         break;
+      case '$':   /* $n{ ... } defines pattern n, $n plays it */
+         n = mml__get_num_modifier_s(p);
+         mml__skipwhite_s(p);
+         if( MML__PEEK(p,0) == '{' && !p->starved )
+         {
+            MML__GLOBAL(p);
+            p->index++;
+            /* definitions don't go inside each other */
+            if( n < 0 || p->defining >= 0 )
+            {
+               p->ignored_braces++;
+               break;
+            }
+            def.id = n;
+            def.slot = mml__add_slot(p);
+            def.ticks = 0;
+            def.depth = 0;
+            sb_push(p->patterns,def);
+            p->defining = sb_count(p->patterns)-1;
+            p->cur = def.slot;
+            p->track_counter = p->sequence_counter;
+            p->sequence_counter = 0;
+            break;
+         }
+         if( p->cur < 0 || p->starved )
+            break;
+         /* the latest finished definition of n, so a pattern can only
+          * play the ones before it and never itself */
+         for( m=( p->defining >= 0 ? p->defining : sb_count(p->patterns) )-1; m>=0; m-- )
+            if( p->patterns[m].id == n )
+               break;
+         ls = &p->loops[p->cur];
+         if( m < 0 || n < 0
+             || ls->depth+1+p->patterns[m].depth > MML_MAX_LOOP_DEPTH )
+            break;
+         if( ls->depth+1+p->patterns[m].depth > ls->deepest )
+            ls->deepest = ls->depth+1+p->patterns[m].depth;
+         mml__arena_push(&p->arena,p->cur,mml__record(MML_PITCH_CALL,0,m));
+         p->lengths[p->cur]++;
+         p->sequence_counter += p->patterns[m].ticks;
+         break;
+      case '}':   /* end of a pattern definition */
+         if( p->ignored_braces || p->defining >= 0 )
+            MML__GLOBAL(p);
+         if( p->ignored_braces )
+         {
+            p->ignored_braces--;
+            break;
+         }
+         if( p->defining < 0 )
+            break;
+         mml__end_pattern(p,&p->patterns[p->defining],&p->loops[p->cur],
+                          &p->lengths[p->cur]);
+         p->sequence_counter = p->track_counter;
+         p->defining = -1;
+         p->cur = p->data.track_count ? (int)p->track_slots[p->current_track] : -1;
+         break;
+      case '[':   /* loop start, stored as a record rather than copies */
+         ls = &p->loops[p->cur];
+         if( ls->depth == MML_MAX_LOOP_DEPTH )
+         {
+            ls->ignored++;
+            break;
+         }
+         ls->open[ls->depth] = p->ms_length[p->cur] + p->sequence_counter;
+         ls->tempo_first[ls->depth] = sb_count(p->tempos);
+         ls->tempos &= ~(1u << ls->depth);
+         ls->depth++;
+         if( ls->depth > ls->deepest )
+            ls->deepest = ls->depth;
+         mml__arena_push(&p->arena,p->cur,mml__record(MML_PITCH_LOOP_BEGIN,0,0));
+         p->lengths[p->cur]++;
+         break;
+      case ']':   /* loop end, n passes (2 without n) */
+         n = mml__get_num_modifier_s(p);
+         if( p->starved )
+            break;
+         ls = &p->loops[p->cur];
+         if( ls->ignored )
+         {
+            ls->ignored--;
+            break;
+         }
+         if( ls->depth == 0 )
+            break;
+         tick = p->ms_length[p->cur] + p->sequence_counter;
+         ls->depth--;
+         body = tick > ls->open[ls->depth] ? tick - ls->open[ls->depth] : 0;
+         n = ( n < 0 ) ? 2 : mml__clamp(n,1,MML_MAX_LOOP_COUNT);
+         /* an empty loop plays once, and the repeats have to fit */
+         if( body == 0 )
+            n = 1;
+         else if( n > 1 && (uint64_t)body*(n-1) > 0xffffffffu - tick )
+         {  /* depends on where the track is, not just on the loop */
+            MML__GLOBAL(p);
+            n = 1 + (0xffffffffu - tick)/body;
+         }
+         if( ls->tempos & (1u << ls->depth) )
+         {  /* the track's tempo changes inside it happen in every pass */
+            MML__GLOBAL(p);
+            ls->tempos &= ~(1u << ls->depth);
+            if( ls->tempo_first[ls->depth] < sb_count(p->tempos) )
+               mml__repeat_tempos(p,ls->tempo_first[ls->depth],body,n);
+         }
+         p->sequence_counter += body*(n-1);
+         mml__arena_push(&p->arena,p->cur,mml__record(MML_PITCH_LOOP_END,n,0));
+         p->lengths[p->cur]++;
+         break;
+      case 'l':   /* note length */
+      {
+         n = mml__get_num_modifier_s(p);
+         if( n > 0 && !p->starved )
+         {
+            p->rs[p->cur].note_length = 1.0/(double)n;
+         }
+      }
+         break;
+      case 'o':   /* note octave */
+          n = mml__get_num_modifier_s(p);
+          if( n != -1 && !p->starved )
+              p->rs[p->cur].octave = mml__clamp(n,0,8);
+          break;
+      case 'v':   /* note volume modifier */
+         n = mml__get_num_modifier_s(p);
+         if( n != -1 && !p->starved )
+            p->rs[p->cur].volume = mml__clamp(n,0,8);
+         break;
+      case 'P':   /* pan */
+         n = mml__get_num_modifier_s(p);
+         if( n != -1 && !p->starved )
+            p->rs[p->cur].pan = mml__clamp(n,0,MML_PAN_MAX);
+         break;
+      case '<':   /* octave shift up */
+          p->rs[p->cur].octave = mml__clamp(p->rs[p->cur].octave+1,0,8);
+          break;
+      case '>':   /* octave shift dn */
+          p->rs[p->cur].octave = mml__clamp(p->rs[p->cur].octave-1,0,8);
+          break;
+      case 'q':   /* note hit length */
+          n = mml__get_num_modifier_s(p);
+          if( n != -1 && !p->starved )
+              p->rs[p->cur].hit_length = mml_quant_values[mml__clamp(n,0,8)];
+          break;
+      case 'a':   /* notes */
+      case 'b':
+      case 'c':
+      case 'd':
+      case 'e':
+      case 'f':
+      case 'g':
+      case 'r':
+      case 'p':
+      {
+         m = mml__get_note_modifier_s(p);
+         i = mml__fetch_note(c,m);
+         nl = mml__get_note_length_s(p,n);
+         if( p->starved )
+            break;
+
+         length = mml__ticks( ( nl < 0 ) ? p->rs[p->cur].note_length : nl );
+
+         p->sequence_counter += length;
+
+         /* the gap is rounded and the note sounds for what's left, so
+          * the two always add up to the written length */
+         if( n > 0 )
+            rest_len = mml__ticks((1.0-p->rs[p->cur].hit_length)*(1.0/(double)n));
+         else
+            rest_len = mml__ticks((1.0-p->rs[p->cur].hit_length)*(p->rs[p->cur].note_length));
+         if( rest_len > length || i == -1 )
+            rest_len = length;
+
+         mml__push_note(&p->arena,p->cur,&p->lengths[p->cur],length,length-rest_len,
+                        (i == -1) ? MML_PITCH_REST : 12*p->rs[p->cur].octave+i,
+                        p->rs[p->cur].volume,p->rs[p->cur].pan);
+      }
+         break;
+      default:
+         break;
+   };
+}
+
+/*  reads commands from p->buf until it runs out. a command cut off at the
+ *  end of a chunk is left unread from p->index on, and a comment or the
+ *  skipping between two commands carries on into the next chunk */
+void mml__parse_text(mml_parser_t* p)
+{
+   unsigned int start;
+
+   while( !p->stopped )
    {
-      if( ms_length[i] > song->data.length )
+      if( p->in_comment )
+      {
+         mml__skipline_s(p);
+         if( p->in_comment )
+            return;
+      }
+      if( !p->in_token )
+      {
+         if( p->index >= p->size )
+            return;
+         /* a NUL where a command would start ends the text */
+         if( p->buf[p->index] == NULLCHAR )
+         {
+            MML__GLOBAL(p);
+            p->stopped = 1;
+            return;
+         }
+         p->in_token = 1;
+      }
+      p->starved = 0;
+      if( !(MML__CLASS(p) & MML__CC_TOKEN) )
+         mml__skip_to_token(p);
+      if( p->starved )
+         return;
+      start = p->index;
+      mml__parse_command(p,MML__GETC(p));
+      if( p->starved )
       {
-         song->data.length = ms_length[i];
+         p->index = start;
+         return;
       }
+      p->in_token = 0;
    }
-   
-   
-   for( i=0; i<song->data.track_count; i++ )
+}
+
+#define MML__IS_SPACE(c)    ( mml__char_class[(unsigned char)(c)] & MML__CC_SPACE )
+
+/*  adds text to the carry. a run of whitespace is kept as at most three
+ *  characters: its first (which a '/' may swallow), then the first '\n'
+ *  after that and one more if the run goes on past it (where a comment
+ *  ends, and whether a NUL after it starts a command). nothing reads
+ *  a run any other way. returns how much of buf it took, all of it
+ *  unless the carry fills up */
+unsigned int mml__carry_append(mml_parser_t* p,const char* buf,unsigned int sz)
+{
+   unsigned int i,run;
+   char * c = p->carry;
+
+   for( i=0; i<sz; i++ )
    {
-      
-      
-      if( ms_length[i] < song->data.length )
+      if( MML__IS_SPACE(buf[i]) && p->carry_count > 0
+          && MML__IS_SPACE(c[p->carry_count-1]) )
       {
-         mml_note_t rest;
-         rest.frequency = 0.0;
-         rest.length = song->data.length - ms_length[i];
-         rest.accum_time = 0.0;
-         
-         
-         sb_push(song->data.tracks[i],rest);
+         for( run=p->carry_count; run>0 && MML__IS_SPACE(c[run-1]); run-- )
+            ;
+         if( p->carry_count - run == 3 )
+            continue;
+         if( p->carry_count - run == 2 && c[run+1] != '\n' )
+         {
+            if( buf[i] == '\n' )
+               c[run+1] = '\n';
+            continue;
+         }
       }
+      if( p->carry_count == MML__CARRY_SIZE )
+         break;
+      c[p->carry_count++] = buf[i];
    }
-   
-      
-   sb_add(song->decode_state.track_pos,song->data.track_count);
-   for( i=0; i<sb_count(song->decode_state.track_pos); i++ )
-      song->decode_state.track_pos[i] = 0;
-   
-   sb_free(ms_length);
-   sb_free(rs); 
-    
-   return song;
+   return i;
+}
+
+void mml__parser_init(mml_parser_t* p)
+{
+   p->buf = NULL;
+   p->index = 0;
+   p->size = 0;
+   p->final = 0;
+   p->starved = 0;
+   p->stopped = 0;
+   p->in_token = 0;
+   p->in_comment = 0;
+   p->carry_count = 0;
+   p->sequence_counter = 0;
+   p->arena.first = p->arena.last = NULL;
+   p->arena.note_count = 0;
+   p->arena.out_of_memory = 0;
+
+   p->data.length = 0;
+   p->data.loop_tick = 0;
+   p->data.volume = 0.0;
+   p->data.track_count = 0;
+   p->data.pattern_count = 0;
+   p->data.waves = NULL;
+   p->wave_define = 1;
+   p->current_track = 0;
+   p->cur = -1;
+   p->rs = NULL;
+   p->loops = NULL;
+   p->ms_length = NULL;
+   p->lengths = NULL;
+   p->track_slots = NULL;
+   p->tempos = NULL;
+   p->patterns = NULL;
+   p->defining = -1;
+   p->ignored_braces = 0;
+   p->track_counter = 0;
+   p->log_segments = 0;
+   p->one_segment = 0;
+   p->segments = NULL;
+}
+
+mml_parser_t* mml_parser_create(void)
+{
+   mml_parser_t* p = (mml_parser_t*)MML_MALLOC(sizeof(mml_parser_t));
+   if( p != NULL )
+      mml__parser_init(p);
+   return p;
+}
+
+void mml_parser_feed(mml_parser_t* p,const char* buf,unsigned int sz)
+{
+   unsigned int n;
+
+   while( sz > 0 && !p->stopped )
+   {
+      if( p->carry_count == 0 )
+      {  /* straight out of the caller's buffer */
+         p->buf = buf;
+         p->size = sz;
+         p->index = 0;
+         mml__parse_text(p);
+         if( !p->stopped )
+            mml__carry_append(p,buf+p->index,sz-p->index);
+         return;
+      }
+      /* finish the command the last chunk cut off, and what fits after it */
+      n = mml__carry_append(p,buf,sz);
+      buf += n;
+      sz -= n;
+      p->buf = p->carry;
+      p->size = p->carry_count;
+      p->index = 0;
+      mml__parse_text(p);
+      p->carry_count -= p->index;
+      memmove(p->carry,p->carry+p->index,p->carry_count);
+   }
+}
+
+/* frees everything a parser holds */
+void mml__parser_release(mml_parser_t* p)
+{
+   mml__arena_free(&p->arena);
+   sb_free(p->lengths);
+   sb_free(p->track_slots);
+   sb_free(p->patterns);
+   sb_free(p->data.waves);
+   sb_free(p->ms_length);
+   sb_free(p->tempos);
+   sb_free(p->loops);
+   sb_free(p->rs);
+   sb_free(p->segments);
+}
+
+/* tempo changes by tick, then in the order they were read */
+int mml__tempo_cmp(const void* a,const void* b)
+{
+   const mml__tempo_t* x = (const mml__tempo_t*)a;
+   const mml__tempo_t* y = (const mml__tempo_t*)b;
+   if( x->tick != y->tick )
+      return x->tick < y->tick ? -1 : 1;
+   return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*  reads whatever the last chunk left and builds the song, then frees
+ *  everything but p itself */
+mml_t* mml__parser_end(mml_parser_t* p)
+{
+   mml_t* result = NULL;
+   mml__arena_chunk_t * chunk;
+   mml__arena_note_t * an;
+   unsigned int * offsets = NULL;
+   unsigned int j,k;
+   unsigned int tempo_count = 0;
+   unsigned int tempo_default;
+   int i;
+
+   /* the text ends here, so the last command reads NULLCHAR past it */
+   p->final = 1;
+   if( !p->stopped )
+   {
+      p->buf = p->carry;
+      p->size = p->carry_count;
+      p->index = 0;
+      mml__parse_text(p);
+   }
+
+   /* a definition left open ends with the file */
+   if( p->defining >= 0 )
+   {
+      mml__end_pattern(p,&p->patterns[p->defining],&p->loops[p->cur],
+                       &p->lengths[p->cur]);
+      p->sequence_counter = p->track_counter;
+   }
+
+   p->data.volume = 1.0/p->data.volume;
+   for( i=0; i<p->data.track_count; i++ )
+   {
+      if( p->ms_length[p->track_slots[i]] > p->data.length )
+      {
+         p->data.length = p->ms_length[p->track_slots[i]];
+      }
+   }
+
+
+   for( i=0; i<p->data.track_count; i++ )
+   {
+      k = p->track_slots[i];
+      /* loops left open play once */
+      mml__close_loops(&p->arena,k,&p->loops[k],&p->lengths[k]);
+
+      if( p->ms_length[k] < p->data.length )
+         mml__push_note(&p->arena,k,&p->lengths[k],p->data.length - p->ms_length[k],0,
+                        MML_PITCH_REST,0,MML_PAN_CENTER);
+   }
+
+   /* the tempo map in tick order, where two tracks set the tempo at the
+    * same point the later one wins */
+   if( sb_count(p->tempos) > 1 )
+      qsort(p->tempos,sb_count(p->tempos),sizeof(mml__tempo_t),mml__tempo_cmp);
+   for( i=0; i<sb_count(p->tempos); i++ )
+   {
+      if( tempo_count > 0 && p->tempos[tempo_count-1].tick == p->tempos[i].tick )
+         tempo_count--;
+      p->tempos[tempo_count++] = p->tempos[i];
+   }
+   /* songs that don't start with a 't' play at the default tempo */
+   tempo_default = ( tempo_count == 0 || p->tempos[0].tick != 0 );
+
+   if( !p->arena.out_of_memory )
+      result = mml__alloc_song(p->data.track_count,sb_count(p->patterns),
+                               p->arena.note_count,tempo_count+tempo_default);
+   if( result != NULL )
+   {
+      result->song.length = p->data.length;
+      result->song.loop_tick = p->data.loop_tick < p->data.length ? p->data.loop_tick : 0;
+      result->song.volume = p->data.volume;
+
+      if( tempo_default )
+      {
+         result->song.tempo_ticks[0] = 0;
+         result->song.tempo_bpm[0] = MML_DEFAULT_TEMPO;
+      }
+      for( j=0; j<tempo_count; j++ )
+      {
+         result->song.tempo_ticks[tempo_default+j] = p->tempos[j].tick;
+         result->song.tempo_bpm[tempo_default+j] = p->tempos[j].bpm;
+      }
+
+      /* the patterns come first, then each track's notes start where the
+       * previous track's end */
+      sb_add(offsets,sb_count(p->rs));
+      for( i=0, k=0; i<sb_count(p->patterns); i++ )
+      {
+         result->song.pattern_lengths[i] = p->lengths[p->patterns[i].slot];
+         offsets[p->patterns[i].slot] = k;
+         k += p->lengths[p->patterns[i].slot];
+      }
+      for( i=0; i<p->data.track_count; i++ )
+      {
+         result->song.waves[i] = p->data.waves[i];
+         result->song.track_lengths[i] = p->lengths[p->track_slots[i]];
+         offsets[p->track_slots[i]] = k;
+         k += p->lengths[p->track_slots[i]];
+      }
+
+      /* chunks are in parse order, so each slot's notes stay in order */
+      for( chunk = p->arena.first; chunk; chunk = chunk->next )
+      {
+         an = MML__ARENA_NOTES(chunk);
+         for( k=0; k<chunk->count; k++ )
+         {
+            j = offsets[an[k].track]++;
+            result->song.notes[j] = an[k].note;
+         }
+      }
+      if( !mml__link_tracks(result) )
+      {
+         MML_FREE(result);
+         result = NULL;
+      }
+   }
+
+   sb_free(offsets);
+   mml__parser_release(p);
+
+   return result;
+}
+
+mml_t* mml_parser_finish(mml_parser_t* p)
+{
+   mml_t* result = mml__parser_end(p);
+   MML_FREE(p);
+   return result;
+}
+
+/* the whole text is one chunk, parsed straight out of buf */
+mml_t* mml_open_mem(const char* buf,unsigned int sz)
+{
+   mml_parser_t parser;
+   mml__parser_init(&parser);
+   mml_parser_feed(&parser,buf,sz);
+   return mml__parser_end(&parser);
+}
+
+/*  live editing. the text is cut into track segments at each ';' (see
+ *  mml__segment_t) and an edit inside one that only touches its own track
+ *  is parsed again from that segment alone, starting from the read and
+ *  loop state its track was in. if it leaves the track's read state
+ *  different, the track's next segments follow until it settles. the new
+ *  records go into the song in place: an edited song's block leaves room
+ *  after every track, so only the edited track's records after the edit
+ *  move, and only if their count changed. the other tracks only have
+ *  their padding redone when the song's length changes, and a track that
+ *  outgrows its room has the song copied to a roomier block.
+ *  the segments after an edit don't change either, their text positions,
+ *  first records and ticks_in are kept as offsets from what Fenwick trees
+ *  of every move since the text was parsed add up to (see mml__edit_seg) */
+struct mml_edit_t {
+    mml_t * m;
+    unsigned int size;          /* of the text m was parsed from */
+    unsigned int capacity;      /* records m's block has room for */
+    int stale;                  /* segments don't match it, parse it all */
+    mml__segment_t * segments;
+    mml__pattern_def_t * patterns;
+    uint32_t * ticks;           /* per track, its length before padding */
+    unsigned int * track_segments;  /* per track, where its trees start, and the end */
+    unsigned int * pinned;      /* per track, 1 + the nth of its last segment
+                                 * that can't move to another tick */
+    int64_t * moved;            /* bytes of text, by segment */
+    int64_t * moved_records;    /* per track from track_segments, by nth */
+    int64_t * moved_ticks;
+    uint32_t loop_tick;         /* as read, before checking the length */
+};
+
+/*  Fenwick trees of how far segments moved, adding v at i moves i and
+ *  every one after it, reading i sums what i moved by */
+void mml__moved_add(int64_t* tree,unsigned int n,unsigned int i,int64_t v)
+{
+    for( i++; i<=n; i += i & (0u-i) )
+        tree[i-1] += v;
+}
+
+int64_t mml__moved_get(const int64_t* tree,unsigned int i)
+{
+    int64_t v = 0;
+    for( i++; i>0; i -= i & (0u-i) )
+        v += tree[i-1];
+    return v;
+}
+
+/* where segment k begins in the text now */
+unsigned int mml__edit_begin(const mml_edit_t* e,unsigned int k)
+{
+    return e->segments[k].begin + (unsigned int)mml__moved_get(e->moved,k);
+}
+
+/* segment k with its moves added */
+mml__segment_t mml__edit_seg(const mml_edit_t* e,unsigned int k)
+{
+    mml__segment_t seg = e->segments[k];
+    const unsigned int base = e->track_segments[seg.track];
+    const unsigned int shift = (unsigned int)mml__moved_get(e->moved,k);
+    seg.begin += shift;
+    seg.end += shift;
+    seg.first += (unsigned int)mml__moved_get(e->moved_records+base,seg.nth);
+    seg.ticks_in += (uint32_t)mml__moved_get(e->moved_ticks+base,seg.nth);
+    return seg;
+}
+
+/* puts seg back as segment k, the moves so far taken off */
+void mml__edit_store(mml_edit_t* e,unsigned int k,mml__segment_t seg)
+{
+    const unsigned int base = e->track_segments[seg.track];
+    const unsigned int shift = (unsigned int)mml__moved_get(e->moved,k);
+    seg.nth = e->segments[k].nth;
+    seg.next = e->segments[k].next;
+    seg.begin -= shift;
+    seg.end -= shift;
+    seg.first -= (unsigned int)mml__moved_get(e->moved_records+base,seg.nth);
+    seg.ticks_in -= (uint32_t)mml__moved_get(e->moved_ticks+base,seg.nth);
+    e->segments[k] = seg;
+}
+
+/* records a track gets room for past need */
+#define MML__EDIT_ROOM(need)    ( (uint64_t)(need) + (need)/4 + 16 )
+
+/*  copies src to a block with room after each track i for it to grow
+ *  to need[i] records and then some, need may be NULL. the player is a
+ *  fresh one. returns NULL if there's no memory */
+mml_t* mml__edit_layout(const mml_t* src,const unsigned int* need,
+                        unsigned int* capacity)
+{
+    const mml_song_t* s = &src->song;
+    mml_song_t* d;
+    mml_t* m;
+    unsigned int i,k,n,patterns_end = 0;
+    uint64_t count;
+
+    for( i=0; i<s->pattern_count; i++ )
+        patterns_end += s->pattern_lengths[i];
+    for( i=0, count=patterns_end; i<s->track_count; i++ )
+    {
+        n = need && need[i] > s->track_lengths[i] ? need[i] : s->track_lengths[i];
+        count += MML__EDIT_ROOM(n);
+    }
+    if( count > 0xffffffffu
+        || (m = mml__alloc_song(s->track_count,s->pattern_count,(unsigned int)count,
+                                s->tempo_count)) == NULL )
+        return NULL;
+    d = &m->song;
+    d->length = s->length;
+    d->loop_tick = s->loop_tick;
+    d->volume = s->volume;
+    d->beats_per_minute = s->beats_per_minute;
+    memcpy(d->tempo_ticks,s->tempo_ticks,sizeof(uint32_t)*s->tempo_count);
+    memcpy(d->tempo_bpm,s->tempo_bpm,sizeof(unsigned int)*s->tempo_count);
+    memcpy(d->tempo_seconds,s->tempo_seconds,sizeof(double)*s->tempo_count);
+    memcpy(d->pattern_lengths,s->pattern_lengths,sizeof(unsigned int)*s->pattern_count);
+    memcpy(d->pattern_offsets,s->pattern_offsets,sizeof(unsigned int)*s->pattern_count);
+    memcpy(d->waves,s->waves,sizeof(unsigned int)*s->track_count);
+    memcpy(d->notes,s->notes,sizeof(mml_note_t)*patterns_end);
+    memcpy(d->starts,s->starts,sizeof(uint32_t)*patterns_end);
+    for( i=0, k=patterns_end; i<s->track_count; i++ )
+    {
+        n = s->track_lengths[i];
+        d->track_offsets[i] = k;
+        d->track_lengths[i] = n;
+        memcpy(d->notes+k,s->notes+s->track_offsets[i],sizeof(mml_note_t)*n);
+        memcpy(d->starts+k,s->starts+s->track_offsets[i],sizeof(uint32_t)*n);
+        k += (unsigned int)MML__EDIT_ROOM(need && need[i] > n ? need[i] : n);
+    }
+    mml__init_player(&m->player,d,d->starts + count);
+    *capacity = (unsigned int)count;
+    return m;
+}
+
+/*  parses the whole text, noting its segments. the song, laid out with
+ *  room to edit, replaces e->m, which is left for the caller to free */
+mml_t* mml__edit_parse(mml_edit_t* e,const char* buf,unsigned int sz)
+{
+    mml_parser_t p;
+    mml__segment_t * seg;
+    mml_t* m;
+    mml_t* packed;
+    unsigned int i,k,n,track_count;
+
+    mml__parser_init(&p);
+    p.log_segments = 1;
+    p.final = 1;
+    p.buf = buf;
+    p.size = sz;
+    mml__parse_text(&p);
+    mml__end_segment(&p,p.stopped ? p.index : p.size,0);
+
+    sb_free(e->segments);
+    sb_free(e->patterns);
+    sb_free(e->ticks);
+    sb_free(e->track_segments);
+    sb_free(e->pinned);
+    sb_free(e->moved);
+    sb_free(e->moved_records);
+    sb_free(e->moved_ticks);
+    e->segments = p.segments;
+    p.segments = NULL;
+    e->patterns = NULL;
+    e->ticks = NULL;
+    e->track_segments = NULL;
+    e->pinned = NULL;
+    e->moved = NULL;
+    e->moved_records = NULL;
+    e->moved_ticks = NULL;
+    if( sb_count(p.patterns) )
+        memcpy(sb_add(e->patterns,sb_count(p.patterns)),p.patterns,
+               sizeof(mml__pattern_def_t)*sb_count(p.patterns));
+    track_count = p.data.track_count;
+    sb_add(e->ticks,track_count);
+    for( i=0; i<track_count; i++ )
+        e->ticks[i] = p.ms_length[p.track_slots[i]];
+    e->loop_tick = p.data.loop_tick;
+
+    /* chain each track's segments and number them, pinned counts them
+     * meanwhile */
+    n = sb_count(e->segments);
+    memset(sb_add(e->track_segments,track_count+1),0,sizeof(unsigned int)*(track_count+1));
+    sb_add(e->pinned,track_count);
+    for( i=0; i<track_count; i++ )
+        e->pinned[i] = n;
+    for( k=n; k-- > 0; )
+    {
+        seg = &e->segments[k];
+        seg->next = e->pinned[seg->track];
+        e->pinned[seg->track] = k;
+        e->track_segments[seg->track+1]++;
+    }
+    for( i=0; i<track_count; i++ )
+    {
+        e->track_segments[i+1] += e->track_segments[i];
+        e->pinned[i] = 0;
+    }
+    for( k=0; k<n; k++ )
+    {
+        seg = &e->segments[k];
+        seg->nth = e->pinned[seg->track]++;
+    }
+    for( i=0; i<track_count; i++ )
+        e->pinned[i] = 0;
+    for( k=0; k<n; k++ )
+    {
+        seg = &e->segments[k];
+        if( seg->global || seg->loops_in.depth > 0 )
+            e->pinned[seg->track] = seg->nth+1;
+    }
+    memset(sb_add(e->moved,n),0,sizeof(int64_t)*n);
+    memset(sb_add(e->moved_records,n),0,sizeof(int64_t)*n);
+    memset(sb_add(e->moved_ticks,n),0,sizeof(int64_t)*n);
+
+    p.stopped = 1;              /* the text is read, only the song is left */
+    packed = mml__parser_end(&p);
+    m = packed ? mml__edit_layout(packed,NULL,&e->capacity) : NULL;
+    mml_free(packed);
+    e->stale = ( m == NULL );
+    if( m != NULL )
+    {
+        e->size = sz;
+        e->m = m;
+    }
+    return m;
+}
+
+/*  parses old, a segment of e's track track, again from buf[0..sz) in
+ *  its track's state rs and ticks. fills in seg and appends its records.
+ *  returns 0 if it can't replace old, its end moved or it did something
+ *  outside its track */
+int mml__edit_segment(mml_edit_t* e,const char* buf,unsigned int sz,
+                      const mml__segment_t* old,mml_read_state_t rs,uint32_t ticks,
+                      mml__segment_t* seg,mml_note_t** records)
+{
+    mml_parser_t p;
+    mml__arena_chunk_t * chunk;
+    unsigned int i;
+    int ok;
+
+    mml__parser_init(&p);
+    p.log_segments = 1;
+    p.one_segment = 1;
+    p.final = 1;
+    p.buf = buf;
+    p.size = sz;
+    p.wave_define = 0;
+    p.data.track_count = e->m->song.track_count;
+    p.current_track = old->track;
+    p.cur = mml__add_slot(&p);
+    p.rs[p.cur] = rs;
+    p.loops[p.cur] = old->loops_in;
+    p.ms_length[p.cur] = ticks;
+    p.lengths[p.cur] = old->first;
+    memset(sb_add(p.track_slots,p.data.track_count),0,
+           sizeof(unsigned int)*p.data.track_count);
+    if( old->patterns )
+        memcpy(sb_add(p.patterns,old->patterns),e->patterns,
+               sizeof(mml__pattern_def_t)*old->patterns);
+    mml__begin_segment(&p);
+    mml__parse_text(&p);
+    mml__end_segment(&p,p.stopped ? p.index : p.size,0);
+
+    *seg = p.segments[0];
+    ok = !seg->global && !p.arena.out_of_memory
+      && seg->ended == old->ended && seg->end == sz
+      && seg->loops_out.depth == old->loops_out.depth
+      && seg->loops_out.ignored == old->loops_out.ignored
+      && seg->loops_out.tempos == old->loops_out.tempos;
+    for( i=0; ok && i<seg->loops_out.depth; i++ )
+        ok = ( seg->loops_out.open[i] == old->loops_out.open[i] );
+    for( chunk = p.arena.first; ok && chunk; chunk = chunk->next )
+        for( i=0; i<chunk->count; i++ )
+            sb_push(*records,MML__ARENA_NOTES(chunk)[i].note);
+    mml__parser_release(&p);
+    return ok;
+}
+
+int mml__same_read_state(const mml_read_state_t* a,const mml_read_state_t* b)
+{
+    return a->note_length == b->note_length && a->hit_length == b->hit_length
+        && a->volume == b->volume && a->octave == b->octave && a->pan == b->pan;
+}
+
+/* rests that pad a track out to the song's length */
+unsigned int mml__padding_records(uint32_t ticks)
+{
+    return (unsigned int)((ticks + (uint64_t)MML_NOTE_MAX_TICKS-1)/MML_NOTE_MAX_TICKS);
+}
+
+/*  carries playback over from the song that was edited, at the same
+ *  sample if it's still inside the song */
+void mml__edit_player(mml_player_t* p,const mml_player_t* old)
+{
+    p->oscillator = old->oscillator;
+    p->held = old->held;
+    memcpy(p->pan,old->pan,sizeof(float)*(p->song->track_count < old->song->track_count
+                                          ? p->song->track_count : old->song->track_count));
+    if( old->rate > 0.0 )
+    {
+        mml__set_rate(p,old->rate);
+        mml__player_locate(p,old->pos < p->song_end ? old->pos : p->loop_start);
+        p->frac = old->pos < p->song_end ? old->frac : 0.0;
+        p->resync = MML__RESYNC_PHASE | MML__RESYNC_EVENTS;
+    }
+    if( old->resync & MML__RESYNC_SEEK )
+    {
+        p->seek_time = old->seek_time;
+        p->resync |= MML__RESYNC_SEEK;
+    }
+}
+
+
+/*  puts a player whose song was edited in place back at the same sample,
+ *  or at the loop point if the song got shorter than that */
+void mml__edit_relocate(mml_player_t* p)
+{
+    const uint32_t pos = p->pos;
+    if( p->rate <= 0.0 )
+        return;
+    p->song_end = mml__tick_sample(p->song,p->rate,p->song->length);
+    p->loop_start = mml__tick_sample(p->song,p->rate,p->song->loop_tick);
+    if( p->loop_start >= p->song_end )
+        p->loop_start = 0;
+    mml__player_locate(p,pos < p->song_end ? pos : p->loop_start);
+    if( pos >= p->song_end )
+        p->frac = 0.0;
+    p->resync |= MML__RESYNC_PHASE | MML__RESYNC_EVENTS;
+}
+
+/*  the tick after the first n of a track's records, linked into notes
+ *  and starts. it's past the track's length by the ticks of a last
+ *  segment that has no ';' */
+uint64_t mml__edit_end(const mml_song_t* s,const mml_note_t* notes,
+                       const uint32_t* starts,unsigned int n)
+{
+    if( n == 0 )
+        return 0;
+    switch( notes[n-1].pitch ) {
+        case MML_PITCH_LOOP_BEGIN:
+        case MML_PITCH_LOOP_END:
+            return starts[n-1];
+        case MML_PITCH_CALL:
+            return (uint64_t)starts[n-1] + MML__PATTERN_TICKS(s,MML__ARG(notes[n-1]));
+        default:
+            return (uint64_t)starts[n-1] + notes[n-1].length;
+    }
+}
+
+/*  pads track i of d, ticks long, from its record n starting at tick at
+ *  out to the song's length. returns the track's record count */
+unsigned int mml__edit_pad(mml_song_t* d,unsigned int i,unsigned int n,
+                           uint32_t ticks,uint32_t at)
+{
+    mml_note_t* notes = d->notes + d->track_offsets[i];
+    uint32_t* starts = d->starts + d->track_offsets[i];
+    for( ; ticks < d->length; n++ )
+    {
+        notes[n] = mml__record(MML_PITCH_REST,0,0);
+        notes[n].length = d->length - ticks < MML_NOTE_MAX_TICKS
+                        ? d->length - ticks : MML_NOTE_MAX_TICKS;
+        starts[n] = at;
+        ticks += notes[n].length;
+        at += notes[n].length;
+    }
+    return n;
+}
+
+/*  the edit as a splice of the segments it touches, into e's song in
+ *  place. returns 0, with nothing changed, if it needs the whole text
+ *  parsed */
+int mml__edit_splice(mml_edit_t* e,const char* buf,unsigned int at,
+                     unsigned int removed,unsigned int added)
+{
+    mml_song_t* s = &e->m->song;
+    mml__segment_t * fresh = NULL;
+    mml_note_t * records = NULL;
+    mml_note_t * track = NULL;
+    uint32_t * starts = NULL;
+    unsigned int * lengths = NULL;
+    mml__segment_t first,old,seg;
+    mml_read_state_t rs;
+    mml_note_t* notes;
+    mml_t* m;
+    unsigned int i,j,k,n,lo,hi,t,tail,end,body,room,base,capacity,last = 0;
+    unsigned int segment_count = sb_count(e->segments);
+    int64_t delta = (int64_t)added - (int64_t)removed;
+    int64_t dticks = 0,drecords,shift = 0;
+    uint64_t pad_at;
+    uint32_t length,old_length,ticks;
+    int whole,grow = 0,ok = 0;
+
+    /* the segment the edit is inside */
+    if( segment_count == 0 || at < mml__edit_begin(e,0) )
+        return 0;
+    for( lo=0, hi=segment_count; hi-lo > 1; )
+    {
+        i = lo + (hi-lo)/2;
+        if( mml__edit_begin(e,i) <= at )
+            lo = i;
+        else
+            hi = i;
+    }
+    j = lo;
+    first = mml__edit_seg(e,j);
+    t = first.track;
+    if( first.global || at + removed > first.end - first.ended )
+        return 0;
+
+    /* parse it again, and the track's next ones while its read state
+     * comes out different */
+    rs = first.rs_in;
+    for( k=j, old=first; ; )
+    {
+        lo = (unsigned int)(old.begin + (k == j ? 0 : delta));
+        hi = (unsigned int)(old.end + delta);
+        if( !mml__edit_segment(e,buf+lo,hi-lo,&old,rs,
+                               (uint32_t)(old.ticks_in + dticks),&seg,&records) )
+            goto done;
+        seg.begin += lo;
+        seg.end += lo;
+        seg.first = first.first + sb_count(records) - seg.records;
+        sb_push(fresh,seg);
+        if( old.ended )
+            dticks += (int64_t)seg.ticks - old.ticks;
+        last = k;
+        if( mml__same_read_state(&seg.rs_out,&old.rs_out) )
+            break;
+        rs = seg.rs_out;
+        if( (k = old.next) == segment_count )
+            break;
+        if( e->segments[k].global )
+            goto done;
+        old = mml__edit_seg(e,k);
+    }
+    /* the track's later records only move if they don't depend on when
+     * they play */
+    if( dticks != 0 && e->pinned[t] > e->segments[last].nth+1 )
+        goto done;
+    ticks = (uint32_t)(e->ticks[t] + dticks);
+    if( (int64_t)e->ticks[t] + dticks != (int64_t)ticks )
+        goto done;
+    n = sb_count(records);
+    tail = old.first + old.records;
+    drecords = (int64_t)n - (tail - first.first);
+
+    /* the track is its body, the loops left open and rests up to the
+     * song's length */
+    base = s->track_offsets[t];
+    end = s->track_lengths[t] - mml__padding_records(s->length - e->ticks[t]);
+    body = (unsigned int)(end + drecords);
+    old_length = s->length;
+    length = ticks;
+    for( i=0; i<s->track_count; i++ )
+        if( i != t && e->ticks[i] > length )
+            length = e->ticks[i];
+
+    /* link the new records before anything changes, on their own from
+     * where the records ahead of them end unless a loop around them takes
+     * in the records on either side. the records after them move by as
+     * much as their end did and the padding starts where the last ends,
+     * it mustn't run past a uint32_t either */
+    notes = s->notes + base;
+    whole = first.loops_in.depth > 0 || seg.loops_out.depth > 0;
+    if( whole )
+    {
+        track = sb_add(track,body);
+        memcpy(track,notes,sizeof(mml_note_t)*first.first);
+        if( n )
+            memcpy(track+first.first,records,sizeof(mml_note_t)*n);
+        memcpy(track+first.first+n,notes+tail,sizeof(mml_note_t)*(end-tail));
+        if( mml__link_span(s,track,sb_add(starts,body),body,0,s->pattern_count,0) < 0 )
+            goto done;
+        pad_at = mml__edit_end(s,track,starts,body);
+    }
+    else
+    {
+        pad_at = mml__edit_end(s,notes,s->starts+base,first.first);
+        if( mml__link_span(s,records,sb_add(starts,n),n,pad_at,s->pattern_count,0) < 0 )
+            goto done;
+        if( n )
+            pad_at = mml__edit_end(s,records,starts,n);
+        shift = (int64_t)pad_at - (int64_t)mml__edit_end(s,notes,s->starts+base,tail);
+        if( end > tail )
+            pad_at = mml__edit_end(s,notes,s->starts+base,end) + shift;
+    }
+    if( pad_at + (length - ticks) > 0xffffffffu )
+        goto done;
+    for( i=0; length > old_length && i<s->track_count; i++ )
+    {
+        k = s->track_lengths[i] - mml__padding_records(old_length - e->ticks[i]);
+        if( i != t && mml__edit_end(s,s->notes+s->track_offsets[i],s->starts+s->track_offsets[i],k)
+                      + (length - e->ticks[i]) > 0xffffffffu )
+            goto done;
+    }
+
+    /* a track without room for its new records moves the song to a
+     * roomier block */
+    sb_add(lengths,s->track_count);
+    for( i=0; i<s->track_count; i++ )
+    {
+        lengths[i] = i == t ? body
+                   : s->track_lengths[i] - mml__padding_records(old_length - e->ticks[i]);
+        lengths[i] += mml__padding_records(length - (i == t ? ticks : e->ticks[i]));
+        room = (i+1 < s->track_count ? s->track_offsets[i+1] : e->capacity)
+             - s->track_offsets[i];
+        grow |= lengths[i] > room;
+    }
+    if( grow )
+    {
+        if( (m = mml__edit_layout(e->m,lengths,&capacity)) == NULL )
+            goto done;
+        mml__edit_player(&m->player,&e->m->player);
+        mml_free(e->m);
+        e->m = m;
+        e->capacity = capacity;
+        s = &m->song;
+        base = s->track_offsets[t];
+    }
+
+    /* nothing can fail from here on */
+    notes = s->notes + base;
+    if( whole )
+    {
+        memcpy(notes,track,sizeof(mml_note_t)*body);
+        memcpy(s->starts+base,starts,sizeof(uint32_t)*body);
+    }
+    else
+    {
+        lo = first.first + n;
+        memmove(notes+lo,notes+tail,sizeof(mml_note_t)*(end-tail));
+        memmove(s->starts+base+lo,s->starts+base+tail,sizeof(uint32_t)*(end-tail));
+        for( k=lo; shift != 0 && k<body; k++ )
+            s->starts[base+k] += (uint32_t)shift;
+        if( n )
+        {
+            memcpy(notes+first.first,records,sizeof(mml_note_t)*n);
+            memcpy(s->starts+base+first.first,starts,sizeof(uint32_t)*n);
+        }
+    }
+    s->length = length;
+    s->loop_tick = e->loop_tick < length ? e->loop_tick : 0;
+    for( i=0; i<s->track_count; i++ )
+    {
+        if( i == t )
+            s->track_lengths[i] = mml__edit_pad(s,i,body,ticks,(uint32_t)pad_at);
+        else if( length != old_length )
+        {
+            k = s->track_lengths[i] - mml__padding_records(old_length - e->ticks[i]);
+            s->track_lengths[i] = mml__edit_pad(s,i,k,e->ticks[i],(uint32_t)
+                mml__edit_end(s,s->notes+s->track_offsets[i],s->starts+s->track_offsets[i],k));
+        }
+    }
+    mml__edit_relocate(&e->m->player);
+
+    /* the segments after the edit move, the re-parsed ones go back in */
+    i = e->track_segments[t];
+    k = e->track_segments[t+1] - i;
+    mml__moved_add(e->moved,segment_count,j+1,delta);
+    mml__moved_add(e->moved_records+i,k,e->segments[last].nth+1,drecords);
+    mml__moved_add(e->moved_ticks+i,k,e->segments[last].nth+1,dticks);
+    for( i=0, k=j; i<(unsigned int)sb_count(fresh); i++, k=e->segments[k].next )
+        mml__edit_store(e,k,fresh[i]);
+    e->ticks[t] = ticks;
+    ok = 1;
+
+done:
+    sb_free(fresh);
+    sb_free(records);
+    sb_free(track);
+    sb_free(starts);
+    sb_free(lengths);
+    return ok;
+}
+
+mml_edit_t* mml_edit_open(const char* buf,unsigned int sz)
+{
+    mml_edit_t* e = (mml_edit_t*)MML_MALLOC(sizeof(mml_edit_t));
+    if( e == NULL )
+        return NULL;
+    e->m = NULL;
+    e->size = 0;
+    e->capacity = 0;
+    e->segments = NULL;
+    e->patterns = NULL;
+    e->ticks = NULL;
+    e->track_segments = NULL;
+    e->pinned = NULL;
+    e->moved = NULL;
+    e->moved_records = NULL;
+    e->moved_ticks = NULL;
+    e->loop_tick = 0;
+    mml__edit_parse(e,buf,sz);
+    return e;
+}
+
+mml_t* mml_edit_apply(mml_edit_t* e,const char* buf,unsigned int sz,
+                      unsigned int at,unsigned int removed,unsigned int added)
+{
+    mml_t* m;
+    mml_t* old;
+
+    if( !e->stale && e->m != NULL && at <= e->size && removed <= e->size - at
+        && (uint64_t)sz + removed == (uint64_t)e->size + added
+        && mml__edit_splice(e,buf,at,removed,added) )
+    {
+        e->size = sz;
+        return e->m;
+    }
+    old = e->m;
+    if( (m = mml__edit_parse(e,buf,sz)) == NULL )
+        return NULL;
+    if( old != NULL )
+        mml__edit_player(&m->player,&old->player);
+    mml_free(old);
+    return m;
+}
+
+mml_t* mml_edit_song(const mml_edit_t* e)
+{
+    return e->m;
+}
+
+void mml_edit_free(mml_edit_t* e)
+{
+    mml_free(e->m);
+    sb_free(e->segments);
+    sb_free(e->patterns);
+    sb_free(e->ticks);
+    sb_free(e->track_segments);
+    sb_free(e->pinned);
+    sb_free(e->moved);
+    sb_free(e->moved_records);
+    sb_free(e->moved_ticks);
+    MML_FREE(e);
 }
 
 
@@ -0,0 +1,173 @@
+/*
+ * mml_bench.cpp
+ *
+ * parse throughput of mml.h on big generated scores
+ *
+ *   c++ -O2 mml_bench.cpp -o mml_bench -lm -pthread
+ *   ./mml_bench [megabytes] [runs]
+ *
+ * each score is megabytes long (16 by default) and parsed runs times (5),
+ * the best time is reported. "dense" is notes with next to no whitespace,
+ * "formatted" is the same kind of music one bar per line with indentation
+ * and comments, as generators and people tend to write it, and "aligned"
+ * pads every note out to a 16 column field as tracker exports do. the compiled
+ * form of the dense score is loaded back for comparison
+ */
+
+#define MML_IMPLEMENTATION
+#include "mml.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned int mml_bench_seed = 12345;
+
+static unsigned int mml_bench_rand(unsigned int n)
+{
+    mml_bench_seed = mml_bench_seed*1103515245 + 12345;
+    return (mml_bench_seed >> 16) % n;
+}
+
+/* appends one note, like "e+16." */
+static char* mml_bench_note(char* out)
+{
+    static const char lengths[][3] = { "", "4", "8", "16", "2" };
+    *out++ = "abcdefgr"[mml_bench_rand(8)];
+    if( mml_bench_rand(4) == 0 )
+        *out++ = mml_bench_rand(2) ? '+' : '-';
+    out += sprintf(out,"%s",lengths[mml_bench_rand(5)]);
+    if( mml_bench_rand(8) == 0 )
+        *out++ = '.';
+    return out;
+}
+
+static const char* mml_bench_styles[] = { "dense", "formatted", "aligned" };
+
+/*  a score of about size bytes in 8 tracks in one of mml_bench_styles.
+ *  formatted puts each bar on its own indented line and a comment every
+ *  few bars, aligned also pads each note to 16 columns */
+static char* mml_bench_score(unsigned int size,int style,unsigned int* sz)
+{
+    char* buf = (char*)malloc(size + 256);
+    char* out = buf;
+    char* track_end;
+    char* note;
+    unsigned int t,bar,k;
+    int formatted = style > 0;
+
+    out += sprintf(out,"w0 w2 w4 w7\nw1 w3 w5 w6\n;\n");
+    for( t=0; t<8; t++ )
+    {
+        track_end = buf + (size/8)*(t+1);
+        out += sprintf(out,"o%u l8 v%u\n",3 + t%3,8 + t%5);
+        for( bar=0; out < track_end; bar++ )
+        {
+            if( formatted && bar % 4 == 0 )
+                out += sprintf(out,"    // bar %u\n",bar);
+            if( formatted )
+                out += sprintf(out,"        ");
+            for( k=0; k<8; k++ )
+            {
+                note = out;
+                out = mml_bench_note(out);
+                if( formatted )
+                    *out++ = ' ';
+                while( style == 2 && out - note < 16 )
+                    *out++ = ' ';
+            }
+            if( mml_bench_rand(16) == 0 )
+                *out++ = mml_bench_rand(2) ? '<' : '>';
+            if( formatted )
+                *out++ = '\n';
+        }
+        out += sprintf(out,";\n");
+    }
+    *sz = (unsigned int)(out - buf);
+    return buf;
+}
+
+static double mml_bench_seconds(void)
+{
+    return (double)clock()/CLOCKS_PER_SEC;
+}
+
+/* best of runs, in MB/s */
+static double mml_bench_parse(const char* buf,unsigned int sz,int runs,unsigned int* notes)
+{
+    double best = 1e30,t;
+    mml_t* m;
+    int i;
+    for( i=0; i<runs; i++ )
+    {
+        t = mml_bench_seconds();
+        m = mml_open_mem(buf,sz);
+        t = mml_bench_seconds() - t;
+        if( m == NULL )
+            return 0.0;
+        *notes = m->song.track_offsets[m->song.track_count-1]
+               + m->song.track_lengths[m->song.track_count-1];
+        mml_free(m);
+        if( t < best )
+            best = t;
+    }
+    return sz/(1024.0*1024.0)/best;
+}
+
+static double mml_bench_load(const char* buf,unsigned int sz,int runs,unsigned int* bytes)
+{
+    double best = 1e30,t;
+    mml_t* m = mml_open_mem(buf,sz);
+    unsigned char* compiled;
+    int i;
+
+    if( m == NULL )
+        return 0.0;
+    *bytes = mml_save_compiled_mem(m,NULL,0);
+    compiled = (unsigned char*)malloc(*bytes);
+    mml_save_compiled_mem(m,compiled,*bytes);
+    mml_free(m);
+    for( i=0; i<runs; i++ )
+    {
+        t = mml_bench_seconds();
+        m = mml_open_compiled_mem(compiled,*bytes);
+        t = mml_bench_seconds() - t;
+        mml_free(m);
+        if( t < best )
+            best = t;
+    }
+    free(compiled);
+    return *bytes/(1024.0*1024.0)/best;
+}
+
+int main(int argc,char** argv)
+{
+    unsigned int megabytes = argc > 1 ? (unsigned int)atoi(argv[1]) : 16;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    unsigned int sz,notes = 0,bytes = 0;
+    double speed;
+    char* buf;
+    int style;
+
+    if( megabytes < 1 || runs < 1 )
+    {
+        printf("usage: mml_bench [megabytes] [runs]\n");
+        return 1;
+    }
+    for( style=0; style<3; style++ )
+    {
+        buf = mml_bench_score(megabytes*1024*1024,style,&sz);
+        speed = mml_bench_parse(buf,sz,runs,&notes);
+        printf("%-10s %6.1f MB  parse %7.1f MB/s  (%u records)\n",
+               mml_bench_styles[style],sz/(1024.0*1024.0),speed,notes);
+        if( style == 0 )
+        {
+            speed = mml_bench_load(buf,sz,runs,&bytes);
+            printf("%-10s %6.1f MB  load  %7.1f MB/s\n","compiled",
+                   bytes/(1024.0*1024.0),speed);
+        }
+        free(buf);
+    }
+    return 0;
+}